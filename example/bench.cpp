@@ -0,0 +1,430 @@
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "external/rapidxml.hpp"
+#include "image.hpp"
+#include "overlapping_wfc.hpp"
+#include "rapidxml_utils.hpp"
+
+using namespace rapidxml;
+using namespace std;
+
+/**
+ * Benchmark of the models of samples.xml over a fixed list of seeds, so two
+ * builds can be compared run for run. Every seed is run repeat times and
+ * its fastest run kept. Usage:
+ *
+ *   wfc_bench [--samples samples.xml] [--seeds 5] [--repeat 3]
+ *             [--engine Auto|Sparse|Dense] [--filter name]
+ *             [--layout RowMajor|Tiled] [--size 1024]
+ *             [--json out.json] [--csv out.csv]
+ *             [--baseline base.csv] [--threshold 10]
+ *
+ * With a baseline (a csv written by a previous run), models whose ns/cell
+ * grew by more than threshold percent are flagged and the exit code is 1.
+ * Models whose outputs changed are reported too. --size overrides the output
+ * size of every model, to compare layouts on large grids.
+ *
+ * peak_rss_delta_mb is the peak resident memory of a model above the
+ * resident memory before it was built, so each model is measured alone.
+ */
+
+struct Args {
+    string samples = "samples.xml";
+    uint32_t seeds = 5;
+    uint32_t repeat = 3;
+    string engine;
+    string filter;
+    string layout = "RowMajor";
+    uint32_t size = 0;
+    string json, csv, baseline;
+    double threshold = 10;
+};
+
+/** One model of samples.xml, measured */
+struct Result {
+    string key;
+    size_t P = 0, L = 0;
+    uint32_t runs = 0, failures = 0;
+
+    double build_ms = 0;
+    double init_ms = 0, select_ms = 0, observe_ms = 0, propagate_ms = 0,
+           restore_ms = 0;
+    size_t observations = 0, bans = 0, decrements = 0, backtracks = 0;
+    size_t queue_peak = 0, largest_wave = 0;
+
+    size_t model_bytes = 0;
+    double peak_rss_delta_mb = 0;
+
+    /** Hash of the successful outputs, to notice behavior changes */
+    uint64_t checksum = 0;
+
+    inline double run_ms() const {
+        return init_ms + select_ms + observe_ms + propagate_ms + restore_ms;
+    }
+    inline double ns_per_cell() const {
+        return run_ms() * 1e6 / (double(L) * runs);
+    }
+    /** 0 when the timers are compiled out (WFC_STATS=0) */
+    inline double bans_per_sec() const {
+        return run_ms() > 0 ? bans / (run_ms() / 1e3) : 0;
+    }
+    inline double contradiction_rate() const {
+        return double(failures) / runs;
+    }
+};
+
+/** Gives the benchmark the model build, which runs otherwise lazily */
+class BenchWFC : public OverlappingWFC {
+   public:
+    using OverlappingWFC::OverlappingWFC;
+    inline void compile() { prepare(); }
+    inline size_t patterns() const { return P; }
+};
+
+/** Peak resident memory of the process in MB, it never goes down */
+static double max_rss_mb() {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024.0 / 1024.0;
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+/**
+ * Resident memory in MB, current or peak. On Linux the peak is the one
+ * since the last reset_peak_rss. Elsewhere both are max_rss_mb, so a
+ * delta only counts the memory a model takes above every earlier model.
+ */
+static double rss_mb(bool peak) {
+    ifstream status("/proc/self/status");
+    const string field = peak ? "VmHWM:" : "VmRSS:";
+    for (string line; getline(status, line);) {
+        if (line.compare(0, field.size(), field) == 0)
+            return stod(line.substr(field.size())) / 1024;
+    }
+    return max_rss_mb();
+}
+
+/**
+ * Lower the Linux peak resident memory to the current one, after giving
+ * the memory freed by earlier models back: else a model would reuse it
+ * without its resident memory growing.
+ */
+static void reset_peak_rss() {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    ofstream("/proc/self/clear_refs") << "5";
+}
+
+static WFC::Heuristic to_heuristic(const string &s) {
+    if (s == "Scanline") return WFC::Heuristic::Scanline;
+    if (s == "MRV") return WFC::Heuristic::MRV;
+    return WFC::Heuristic::Entropy;
+}
+
+static WFC::Layout to_layout(const string &s) {
+    if (s == "Tiled") return WFC::Layout::Tiled;
+    return WFC::Layout::RowMajor;
+}
+
+static WFC::Engine to_engine(const string &s) {
+    if (s == "Sparse") return WFC::Engine::Sparse;
+    if (s == "Dense") return WFC::Engine::Dense;
+    return WFC::Engine::Auto;
+}
+
+static optional<Result> bench(xml_node<> *node, const Args &args) {
+    string name = get_attribute(node, "name");
+    if (!args.filter.empty() && name.find(args.filter) == string::npos)
+        return nullopt;
+
+    auto size = get_attribute(node, "size", "48");
+    uint32_t width = stoi(get_attribute(node, "width", size));
+    uint32_t height = stoi(get_attribute(node, "height", size));
+    if (args.size) width = height = args.size;
+    uint32_t N = stoi(get_attribute(node, "N", "3"));
+    bool periodic_output = get_attribute(node, "periodic", "False") == "True";
+    bool periodic_input =
+        get_attribute(node, "periodicInput", "True") == "True";
+    bool ground = get_attribute(node, "ground", "False") == "True";
+    uint32_t symmetry = stoi(get_attribute(node, "symmetry", "8"));
+    string heuristic = get_attribute(node, "heuristic", "Entropy");
+    string engine = args.engine.empty()
+                        ? get_attribute(node, "engine", "Auto")
+                        : args.engine;
+    uint32_t backtracks = stoi(get_attribute(node, "backtracks", "0"));
+
+    auto m = read_image("samples/" + name + ".png");
+    if (!m.has_value()) {
+        cerr << "skipping " << name << ": can't read its image" << endl;
+        return nullopt;
+    }
+    auto &img = m.value();
+
+    OverlappingWFC::Options options = {
+        .periodic_input = periodic_input,
+        .periodic_output = periodic_output,
+        .i_W = img.MX,
+        .i_H = img.MY,
+        .o_W = width,
+        .o_H = height,
+        .symmetry = uint32_t((1 << symmetry) - 1),
+        .pattern_size = N,
+        .heuristic = to_heuristic(heuristic),
+        .ground = ground,
+        .engine = to_engine(engine),
+        .backtracks = backtracks,
+        .layout = to_layout(args.layout),
+    };
+
+    Result r;
+    r.key = name + ":N" + to_string(N) + ":" + to_string(width) + "x" +
+            to_string(height) + ":s" + to_string(symmetry) +
+            (ground ? ":ground" : "") + ":" + heuristic + ":" + engine +
+            (args.layout == "RowMajor" ? "" : ":" + args.layout);
+
+    reset_peak_rss();
+    const double rss_before = rss_mb(false);
+
+    BenchWFC wfc(options, img);
+
+    auto start = chrono::steady_clock::now();
+    wfc.compile();
+    r.build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() -
+                                                 start)
+                     .count();
+
+    r.P = wfc.patterns();
+    r.L = width * height;
+    r.runs = args.seeds;
+    r.model_bytes = wfc.bytes();
+
+    for (uint32_t seed = 0; seed < args.seeds; seed++) {
+        bool success = false;
+        Stats best;
+        double best_ms = -1;
+
+        for (uint32_t k = 0; k < max(1u, args.repeat); k++) {
+            success = wfc.run(seed);
+            const auto &s = wfc.stats();
+            double ms = s.total_ms();
+            if (best_ms < 0 || ms < best_ms) {
+                best = s;
+                best_ms = ms;
+            }
+        }
+
+        r.failures += !success;
+        r.init_ms += best.init_ms();
+        r.select_ms += best.select_ms();
+        r.observe_ms += best.observe_ms();
+        r.propagate_ms += best.propagate_ms();
+        r.restore_ms += best.restore_ms();
+        r.observations += best.observations;
+        r.bans += best.bans;
+        r.decrements += best.decrements;
+        r.backtracks += best.backtracks;
+        r.queue_peak = max(r.queue_peak, best.queue_peak);
+        r.largest_wave = max(r.largest_wave, best.largest_wave);
+
+        if (success) {
+            for (const auto &px : wfc.get_output().data) {
+                for (uint8_t c : px)
+                    r.checksum = (r.checksum ^ c) * 1099511628211ull;
+            }
+        }
+    }
+
+    r.peak_rss_delta_mb = rss_mb(true) - rss_before;
+    return r;
+}
+
+static const char *CSV_HEADER =
+    "model,P,cells,runs,contradiction_rate,build_ms,init_ms,select_ms,"
+    "observe_ms,propagate_ms,restore_ms,ns_per_cell,bans_per_sec,"
+    "observations,bans,decrements,backtracks,queue_peak,largest_wave,"
+    "model_bytes,peak_rss_delta_mb,checksum";
+
+static string csv_row(const Result &r) {
+    ostringstream o;
+    o << r.key << "," << r.P << "," << r.L << "," << r.runs << ","
+      << r.contradiction_rate() << "," << r.build_ms << "," << r.init_ms
+      << "," << r.select_ms << "," << r.observe_ms << "," << r.propagate_ms
+      << "," << r.restore_ms << "," << r.ns_per_cell() << ","
+      << r.bans_per_sec() << "," << r.observations << "," << r.bans << ","
+      << r.decrements << "," << r.backtracks << "," << r.queue_peak << ","
+      << r.largest_wave << "," << r.model_bytes << ","
+      << r.peak_rss_delta_mb << "," << hex << r.checksum;
+    return o.str();
+}
+
+static void write_json(const string &path, const vector<Result> &results) {
+    ofstream o(path);
+    o << "[\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto &r = results[i];
+        o << "  {\"model\": \"" << r.key << "\", \"runs\": " << r.runs
+          << ", \"cells\": " << r.L
+          << ", \"contradiction_rate\": " << r.contradiction_rate()
+          << ", \"build_ms\": " << r.build_ms << ", \"init_ms\": " << r.init_ms
+          << ", \"select_ms\": " << r.select_ms
+          << ", \"observe_ms\": " << r.observe_ms
+          << ", \"propagate_ms\": " << r.propagate_ms
+          << ", \"restore_ms\": " << r.restore_ms
+          << ", \"ns_per_cell\": " << r.ns_per_cell()
+          << ", \"bans_per_sec\": " << r.bans_per_sec()
+          << ", \"observations\": " << r.observations
+          << ", \"bans\": " << r.bans << ", \"decrements\": " << r.decrements
+          << ", \"backtracks\": " << r.backtracks
+          << ", \"queue_peak\": " << r.queue_peak
+          << ", \"largest_wave\": " << r.largest_wave
+          << ", \"model_bytes\": " << r.model_bytes
+          << ", \"peak_rss_delta_mb\": " << r.peak_rss_delta_mb
+          << ", \"checksum\": \""
+          << hex << r.checksum << dec << "\"}"
+          << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    o << "]\n";
+}
+
+/**
+ * Compare against a csv of a previous run, return the number of models
+ * whose ns/cell regressed by more than the threshold.
+ */
+static size_t compare(const string &path, const vector<Result> &results,
+                      double threshold) {
+    ifstream in(path);
+    if (!in) {
+        cerr << "can't read baseline " << path << endl;
+        return 0;
+    }
+
+    // model -> (ns_per_cell, checksum), columns as in CSV_HEADER
+    map<string, pair<double, string>> base;
+    string line;
+    getline(in, line);
+    while (getline(in, line)) {
+        vector<string> cols;
+        stringstream ss(line);
+        for (string c; getline(ss, c, ',');) cols.push_back(c);
+        if (cols.size() == 22) base[cols[0]] = {stod(cols[11]), cols[21]};
+    }
+
+    size_t regressions = 0;
+    for (const auto &r : results) {
+        auto it = base.find(r.key);
+        if (it == base.end()) continue;
+
+        const double before = it->second.first, now = r.ns_per_cell();
+        const double change = (now - before) / before * 100;
+
+        ostringstream checksum;
+        checksum << hex << r.checksum;
+
+        cout << r.key << ": " << before << " -> " << now << " ns/cell ("
+             << (change > 0 ? "+" : "") << change << "%)";
+        if (change > threshold) {
+            cout << " REGRESSION";
+            regressions++;
+        }
+        if (checksum.str() != it->second.second) cout << " OUTPUT CHANGED";
+        cout << endl;
+    }
+    return regressions;
+}
+
+static int usage(const char *name) {
+    cerr << "usage: " << name
+         << " [--samples samples.xml] [--seeds 5] [--repeat 3]\n"
+            "    [--engine Auto|Sparse|Dense] [--filter name]\n"
+            "    [--layout RowMajor|Tiled] [--size 1024]\n"
+            "    [--json out.json] [--csv out.csv]\n"
+            "    [--baseline base.csv] [--threshold 10]"
+         << endl;
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    Args args;
+    for (int i = 1; i < argc; i += 2) {
+        string flag = argv[i];
+        if (i + 1 == argc) {
+            cerr << "missing value for " << flag << endl;
+            return usage(argv[0]);
+        }
+
+        string value = argv[i + 1];
+        try {
+            if (flag == "--samples") args.samples = value;
+            else if (flag == "--seeds") args.seeds = stoi(value);
+            else if (flag == "--repeat") args.repeat = stoi(value);
+            else if (flag == "--engine") args.engine = value;
+            else if (flag == "--filter") args.filter = value;
+            else if (flag == "--layout") args.layout = value;
+            else if (flag == "--size") args.size = stoi(value);
+            else if (flag == "--json") args.json = value;
+            else if (flag == "--csv") args.csv = value;
+            else if (flag == "--baseline") args.baseline = value;
+            else if (flag == "--threshold") args.threshold = stod(value);
+            else {
+                cerr << "unknown option " << flag << endl;
+                return usage(argv[0]);
+            }
+        } catch (const logic_error &) {
+            cerr << "bad value " << value << " for " << flag << endl;
+            return usage(argv[0]);
+        }
+    }
+
+    ifstream config_file(args.samples);
+    vector<char> buffer((istreambuf_iterator<char>(config_file)),
+                        istreambuf_iterator<char>());
+    buffer.push_back('\0');
+    xml_document<> document;
+    document.parse<0>(&buffer[0]);
+
+    vector<Result> results;
+    xml_node<> *root = document.first_node("samples");
+    for (xml_node<> *node = root ? root->first_node("overlapping") : nullptr;
+         node; node = node->next_sibling("overlapping")) {
+        if (auto r = bench(node, args)) {
+            cout << csv_row(*r) << endl;
+            results.push_back(*r);
+        }
+    }
+
+    if (!args.csv.empty()) {
+        ofstream o(args.csv);
+        o << CSV_HEADER << "\n";
+        for (const auto &r : results) o << csv_row(r) << "\n";
+    }
+    if (!args.json.empty()) write_json(args.json, results);
+
+    if (!args.baseline.empty() &&
+        compare(args.baseline, results, args.threshold))
+        return 1;
+    return 0;
+}
@@ -7,12 +7,14 @@
 #include <unordered_set>
 
 #include "external/rapidxml.hpp"
+#include "chunked_wfc.hpp"
 #include "image.hpp"
 #include "overlapping_wfc.hpp"
 #include "rapidxml_utils.hpp"
 #include "time.h"
 #include "utils.hpp"
 #include "utils/array_3d.hpp"
+#include "utils/thread_pool.hpp"
 #include "wfc.hpp"
 
 using namespace rapidxml;
@@ -32,9 +34,9 @@ int get_random_seed() {
 #endif
 }
 
-Wave::Heuristic to_heuristic(const string &heuristic_string) {
+WFC::Heuristic to_heuristic(const string &heuristic_string) {
 #define CASE(enum) \
-    if (heuristic_string == #enum) return Wave::Heuristic::enum
+    if (heuristic_string == #enum) return WFC::Heuristic::enum
 
     CASE(Scanline);
     CASE(Entropy);
@@ -44,10 +46,58 @@ Wave::Heuristic to_heuristic(const string &heuristic_string) {
 #undef CASE
 }
 
+WFC::Engine to_engine(const string &engine_string) {
+#define CASE(enum) \
+    if (engine_string == #enum) return WFC::Engine::enum
+
+    CASE(Auto);
+    CASE(Sparse);
+    CASE(Dense);
+
+    throw runtime_error("Invalid Engine: " + engine_string);
+#undef CASE
+}
+
+/**
+ * Generate a chunks x chunks region of a chunked world, each chunk being
+ * options.o_W pixels wide, and stitch it into one image.
+ */
+void run_chunked(const string &name, const OverlappingWFC::Options &options,
+                 const Array2D<uint32_t> &img, uint32_t chunks,
+                 ThreadPool &pool) {
+    uint64_t seed = get_random_seed();
+    ChunkedWFC world(options, img, options.o_W, seed, chunks * chunks);
+    world.generate(0, 0, chunks, chunks, pool);
+
+    const size_t S = world.chunk_size();
+    OverlappingWFC::Image out(S * chunks, S * chunks);
+    size_t failed = 0;
+
+    for (uint32_t cy = 0; cy < chunks; cy++) {
+        for (uint32_t cx = 0; cx < chunks; cx++) {
+            const auto &chunk = world.get(cx, cy);
+            failed += !chunk.success;
+
+            auto image = world.image(chunk);
+            for (size_t y = 0; y < S; y++) {
+                for (size_t x = 0; x < S; x++) {
+                    out.set(cx * S + x, cy * S + y, image.get(x, y));
+                }
+            }
+        }
+    }
+
+    cout << "> WORLD " << chunks << "x" << chunks << " chunks";
+    if (failed) cout << " (" << failed << " contradicted)";
+    cout << endl;
+    write_image_png("results/" + name + "_world" + to_string(seed) + ".png",
+                    out);
+}
+
 /**
  * Read the overlapping wfc problem from the xml node.
  */
-void run_overlapping(xml_node<> *node) {
+void run_overlapping(xml_node<> *node, ThreadPool &pool) {
     string name = get_attribute(node, "name");
 
     auto size = get_attribute(node, "size", "48");
@@ -64,6 +114,11 @@ void run_overlapping(xml_node<> *node) {
     uint32_t symmetry = stoi(get_attribute(node, "symmetry", "8"));
     uint32_t screenshots = stoi(get_attribute(node, "screenshots", "2"));
     string heuristic = get_attribute(node, "heuristic", "Entropy");
+    string engine = get_attribute(node, "engine", "Auto");
+    uint32_t backtracks = stoi(get_attribute(node, "backtracks", "0"));
+    uint32_t chunks = stoi(get_attribute(node, "chunks", "0"));
+    uint32_t stripes = stoi(get_attribute(node, "stripes", "0"));
+    bool compiled = get_attribute(node, "compiled", "False") == "True";
 
     cerr << "< " << name << endl;
 
@@ -87,24 +142,57 @@ void run_overlapping(xml_node<> *node) {
         .pattern_size = N,
         .heuristic = to_heuristic(heuristic),
         .ground = ground,
+        .engine = to_engine(engine),
+        .backtracks = backtracks,
     };
 
+    if (chunks) {
+        run_chunked(name, options, img, chunks, pool);
+        return;
+    }
+
     OverlappingWFC wfc(options, img);
 
+    if (compiled) {
+        // Reuse the model compiled by a previous run of the same input
+        char key[17];
+        snprintf(key, sizeof(key), "%016llx",
+                 (unsigned long long)OverlappingWFC::key(options, img));
+        const string path = "results/" + name + "_" + key + ".wfcm";
+        if (!wfc.load(path)) wfc.save(path);
+    }
+
     for (uint32_t i = 0; i < screenshots; i++) {
-        for (uint32_t test = 0; test < 10; test++) {
-            int seed = get_random_seed();
-            bool success = wfc.run(seed);
-
-            cout << "> ";
-            if (success) {
-                cout << "DONE" << endl;
-                write_image_png("results/" + name + to_string(seed) + ".png",
-                                wfc.get_output());
-                break;
-            } else {
-                cout << "CONTRADICTION" << endl;
+        // Up to 10 seeds raced across the pool, the first success wins
+        vector<uint32_t> seeds(10);
+        for (auto &seed : seeds) seed = get_random_seed();
+
+        optional<uint32_t> seed;
+        if (stripes) {
+            // One output propagated across the pool, seeds tried in turn
+            for (auto s : seeds) {
+                if (wfc.run_striped(s, pool, stripes, true)) {
+                    seed = s;
+                    break;
+                }
+            }
+        } else {
+            seed = wfc.race(seeds, pool);
+        }
+
+        cout << "> ";
+        if (seed.has_value()) {
+            cout << "DONE";
+            if (wfc.stats().backtracks) {
+                cout << " (" << wfc.stats().backtracks << " backtracks, "
+                     << wfc.stats().restored << " bans restored in "
+                     << wfc.stats().restore_ms() << "ms)";
             }
+            cout << endl;
+            write_image_png("results/" + name + to_string(*seed) + ".png",
+                            wfc.get_output());
+        } else {
+            cout << "CONTRADICTION" << endl;
         }
     }
 }
@@ -122,9 +210,10 @@ void read_config_file(const string &config_path) noexcept {
 
     xml_node<> *root_node = document->first_node("samples");
     string dir_path = get_dir(config_path) + "/" + "samples";
+    ThreadPool pool;
     for (xml_node<> *node = root_node->first_node("overlapping"); node;
          node = node->next_sibling("overlapping")) {
-        run_overlapping(node);
+        run_overlapping(node, pool);
     }
 
     delete document;
@@ -0,0 +1,271 @@
+#ifndef WFC_CHUNKED_WFC_HPP_
+#define WFC_CHUNKED_WFC_HPP_
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+#include "overlapping_wfc.hpp"
+
+using std::unordered_map;
+
+/**
+ * Streams an unbounded world as square chunks of S x S pixels, each one
+ * generated on demand by the overlapping model over T x T pixels,
+ * T = S + N - 1. Chunk (cx, cy) starts at world pixel (cx * S, cy * S), so
+ * neighboring chunks share N - 1 rows or columns of pixels. Before
+ * propagating, a chunk bans every pattern disagreeing with the pixels of its
+ * resident neighbors (diagonal ones included), and continues them
+ * seamlessly.
+ *
+ * The grid has a margin of N - 1 anchors around the observed ones, which
+ * are propagated but never observed: the border a chunk leaves can then be
+ * continued, and the next chunk's margin picks up its neighbors' interior.
+ *
+ * Attempt a of chunk (cx, cy) is seeded from (world seed, cx, cy, a), a
+ * chunk only depending on which of its neighbors were resident when it was
+ * generated. At most `resident` chunks are kept, the least recently used
+ * being evicted first, so memory does not grow with the explored world.
+ */
+class ChunkedWFC : public OverlappingWFC {
+   public:
+    struct Chunk {
+        int64_t cx, cy;
+        /** False if every attempt contradicted, pixels are then unreliable */
+        bool success;
+        /** Color index of the T x T pixels, the last N - 1 being shared */
+        Array2D<Color> pixels;
+    };
+
+   private:
+    using Key = std::pair<int64_t, int64_t>;
+
+    static inline uint64_t mix(uint64_t h, uint64_t v) noexcept {
+        xoshiro256ss::u64 x = h ^ v;
+        return xoshiro256ss::splitmix64(x);
+    }
+
+    struct KeyHash {
+        size_t operator()(const Key &k) const noexcept {
+            return mix(mix(0, k.first), k.second);
+        }
+    };
+
+    /** Chunk stride and pixel size */
+    const size_t S, T;
+    const uint64_t world;
+    const size_t resident;
+    const uint32_t attempts;
+
+    /** Resident chunks, most recently used first */
+    std::list<Chunk> lru;
+    unordered_map<Key, std::list<Chunk>::iterator, KeyHash> table;
+
+    /** The T x T pixels plus a margin of N - 1 anchors on every side */
+    static Options chunk_options(Options options, size_t S) noexcept {
+        options.o_W = options.o_H = S + 3 * (options.pattern_size - 1);
+        options.periodic_output = false;
+        return options;
+    }
+
+    inline void insert(Chunk &&chunk) {
+        const Key key{chunk.cx, chunk.cy};
+        lru.push_front(std::move(chunk));
+        table[key] = lru.begin();
+
+        while (lru.size() > resident) {
+            table.erase({lru.back().cx, lru.back().cy});
+            lru.pop_back();
+        }
+    }
+
+    /**
+     * Color index of chunk pixel (x, y), read from the observed anchor
+     * covering it.
+     */
+    inline Color pixel(const Solver &s, size_t x, size_t y) const noexcept {
+        const size_t G = N - 1;
+        const size_t ax = std::min(x, S - 1), ay = std::min(y, S - 1);
+        const size_t index = cell(ax + G, ay + G);
+
+        const int64_t p = Bits::first(s.words(index), Bits::words(P));
+        return p < 0 ? 0 : patterns[p][x - ax + (y - ay) * N];
+    }
+
+    /**
+     * Generate chunk (cx, cy) on s. Only reads the resident chunks, so
+     * chunks that are not neighbors can be generated concurrently.
+     */
+    Chunk generate_chunk(Solver &s, int64_t cx, int64_t cy) noexcept {
+        constexpr Color UNKNOWN = MAX_COLORS;
+        const int64_t G = N - 1;
+
+        // Pixels fixed by the resident neighbors, over the whole grid
+        Array2D<Color> known(MX, MY, UNKNOWN);
+        bool constrained = false;
+
+        for (int64_t oy = -1; oy <= 1; oy++) {
+            for (int64_t ox = -1; ox <= 1; ox++) {
+                const Chunk *n = find(cx + ox, cy + oy);
+                if (!n || !n->success || (!ox && !oy)) continue;
+
+                // Cell (x, y) is pixel (x - G - ox * S, y - G - oy * S) there
+                for (size_t y = 0; y < MY; y++) {
+                    const int64_t y2 = int64_t(y) - G - oy * int64_t(S);
+                    if (y2 < 0 || y2 >= int64_t(T)) continue;
+
+                    for (size_t x = 0; x < MX; x++) {
+                        const int64_t x2 = int64_t(x) - G - ox * int64_t(S);
+                        if (x2 < 0 || x2 >= int64_t(T)) continue;
+
+                        known.set(x, y, n->pixels.get(x2, y2));
+                        constrained = true;
+                    }
+                }
+            }
+        }
+
+        // True if pattern p anchored at (x, y) matches the known pixels
+        auto agrees = [&](size_t p, size_t x, size_t y) {
+            const auto &pattern = patterns[p];
+            for (size_t dy = 0; dy < N; dy++) {
+                for (size_t dx = 0; dx < N; dx++) {
+                    const Color c = known.get(x + dx, y + dy);
+                    if (c != UNKNOWN && c != pattern[dx + dy * N]) return false;
+                }
+            }
+            return true;
+        };
+
+        // Margin anchors included, they carry the neighbors' interior
+        auto constrain = [&](Solver &) {
+            if (!constrained) return false;
+
+            const size_t W = Bits::words(P);
+            bool banned = false;
+            for (size_t y = 0; y + N <= MY; y++) {
+                for (size_t x = 0; x + N <= MX; x++) {
+                    // Bits are read a word at a time, banning is safe
+                    const size_t i = cell(x, y);
+                    Bits::for_each(s.words(i), W, [&](size_t p) {
+                        if (!agrees(p, x, y)) {
+                            s.ban(i, p);
+                            banned = true;
+                        }
+                    });
+                }
+            }
+            return banned;
+        };
+
+        Chunk chunk{.cx = cx,
+                    .cy = cy,
+                    .success = false,
+                    .pixels = Array2D<Color>(T, T)};
+
+        for (uint32_t a = 0; a < attempts && !chunk.success; a++) {
+            chunk.success = attempt(s, mix(mix(mix(world, cx), cy), a), -1,
+                                    constrain);
+        }
+
+        for (size_t y = 0; y < T; y++) {
+            for (size_t x = 0; x < T; x++) {
+                chunk.pixels.set(x, y, pixel(s, x, y));
+            }
+        }
+
+        return chunk;
+    }
+
+   public:
+    /**
+     * options.o_W, o_H and periodic_output are ignored, chunks being
+     * chunk_size pixels apart. A chunk failing `attempts` times is kept
+     * with success = false.
+     */
+    ChunkedWFC(const Options &options, const Array2D<uint32_t> &input,
+               size_t chunk_size, uint64_t world_seed, size_t resident = 64,
+               uint32_t attempts = 10)
+        : OverlappingWFC(chunk_options(options, chunk_size), input),
+          S(chunk_size),
+          T(chunk_size + options.pattern_size - 1),
+          world(world_seed),
+          resident(resident),
+          attempts(attempts) {
+        margin = options.pattern_size - 1;
+    }
+
+    inline size_t chunk_size() const noexcept { return S; }
+
+    /** Resident chunk (cx, cy), or nullptr */
+    const Chunk *find(int64_t cx, int64_t cy) const noexcept {
+        auto it = table.find({cx, cy});
+        return it == table.end() ? nullptr : &*it->second;
+    }
+
+    /**
+     * Chunk (cx, cy), generated against its resident neighbors if it is not
+     * resident itself. The reference is valid until the chunk is evicted.
+     */
+    const Chunk &get(int64_t cx, int64_t cy) {
+        auto it = table.find({cx, cy});
+        if (it != table.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            return lru.front();
+        }
+
+        prepare();
+        insert(generate_chunk(*solver, cx, cy));
+        return lru.front();
+    }
+
+    /**
+     * Generate the missing chunks of [cx0, cx1) x [cy0, cy1) across the pool,
+     * in four phases by coordinate parity: chunks of a phase are never
+     * neighbors, so they only read chunks of the previous phases. The
+     * result does not depend on the pool size. resident should hold the
+     * whole region, or its first chunks are evicted before the last ones
+     * could continue them.
+     */
+    void generate(int64_t cx0, int64_t cy0, int64_t cx1, int64_t cy1,
+                  ThreadPool &pool) {
+        hire(pool);
+
+        vector<Key> keys;
+        vector<Chunk> done;
+
+        for (int64_t phase = 0; phase < 4; phase++) {
+            keys.clear();
+            for (int64_t cy = cy0; cy < cy1; cy++) {
+                for (int64_t cx = cx0; cx < cx1; cx++) {
+                    if (((cx & 1) | (cy & 1) << 1) != phase) continue;
+                    if (!find(cx, cy)) keys.push_back({cx, cy});
+                }
+            }
+
+            done.assign(keys.size(), Chunk{.cx = 0,
+                                           .cy = 0,
+                                           .success = false,
+                                           .pixels = Array2D<Color>(0, 0)});
+            pool.for_each(keys.size(), [&](size_t task, size_t worker) {
+                done[task] = generate_chunk(*workers[worker], keys[task].first,
+                                            keys[task].second);
+            });
+
+            for (auto &chunk : done) insert(std::move(chunk));
+        }
+    }
+
+    /** The S x S pixels owned by a chunk */
+    Image image(const Chunk &chunk) const noexcept {
+        Image out(S, S);
+        for (size_t y = 0; y < S; y++) {
+            for (size_t x = 0; x < S; x++) {
+                out.set(x, y, rgb(colors[chunk.pixels.get(x, y)]));
+            }
+        }
+        return out;
+    }
+};
+
+#endif  // WFC_CHUNKED_WFC_HPP_
@@ -0,0 +1,124 @@
+#ifndef WFC_COMPILED_MODEL_HPP_
+#define WFC_COMPILED_MODEL_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include "utils/mapped_file.hpp"
+
+/**
+ * Versioned binary file of a built model: a fixed Header, then one section
+ * per array, each starting at a multiple of ALIGN bytes so it can be read
+ * in place from a memory mapping. Numbers are stored in the native byte
+ * order, a file of the other order fails the magic check.
+ */
+namespace Compiled {
+
+constexpr uint32_t MAGIC = 0x4d434657;  // "WFCM"
+constexpr uint32_t VERSION = 1;
+constexpr size_t ALIGN = 64;
+
+enum Section : uint32_t {
+    Patterns,  // P patterns, pattern_bytes each
+    Colors,    // uint32_t per color
+    Weights,   // double per pattern
+    WLogW,     // double per pattern, weight * log(weight)
+    Table,     // Propagator::Entry per (direction, pattern), direction first
+    Flat,      // compatible lists, flat_width bytes per pattern id
+    SECTIONS
+};
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+
+    /** Hash of what the model was built from, see OverlappingWFC::key */
+    uint64_t key;
+
+    uint64_t P, D;
+    uint64_t pattern_bytes;
+    uint64_t flat_width;
+
+    double density;
+    double wSum, wSumLogW, e0;
+
+    struct {
+        uint64_t offset;
+        uint64_t bytes;
+    } sections[SECTIONS];
+};
+
+/** Data of one section when writing */
+struct Data {
+    const void* ptr;
+    uint64_t bytes;
+};
+
+/** Write header and sections to path, filling the section offsets */
+inline bool write(const std::string& path, Header header,
+                  const Data (&data)[SECTIONS]) {
+    uint64_t offset = sizeof(Header);
+    for (uint32_t s = 0; s < SECTIONS; s++) {
+        offset = (offset + ALIGN - 1) / ALIGN * ALIGN;
+        header.sections[s] = {offset, data[s].bytes};
+        offset += data[s].bytes;
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) return false;
+
+    const char zeros[ALIGN] = {};
+    file.write((const char*)&header, sizeof(Header));
+
+    uint64_t at = sizeof(Header);
+    for (uint32_t s = 0; s < SECTIONS; s++) {
+        file.write(zeros, header.sections[s].offset - at);
+        file.write((const char*)data[s].ptr, data[s].bytes);
+        at = header.sections[s].offset + data[s].bytes;
+    }
+
+    return bool(file);
+}
+
+/**
+ * A mapped compiled model, empty unless the file exists, has the current
+ * version, the expected key and every section fits in it.
+ */
+class File {
+    MappedFile file;
+    const Header* h = nullptr;
+
+   public:
+    File(const std::string& path, uint64_t key) noexcept : file(path) {
+        if (!file || file.size() < sizeof(Header)) return;
+
+        auto header = (const Header*)file.data();
+        if (header->magic != MAGIC || header->version != VERSION ||
+            header->key != key)
+            return;
+
+        for (const auto& s : header->sections) {
+            if (s.offset % ALIGN || s.offset > file.size() ||
+                s.bytes > file.size() - s.offset)
+                return;
+        }
+
+        h = header;
+    }
+
+    inline explicit operator bool() const noexcept { return h; }
+    inline const Header& header() const noexcept { return *h; }
+
+    inline const uint8_t* section(Section s) const noexcept {
+        return file.data() + h->sections[s].offset;
+    }
+    inline uint64_t bytes(Section s) const noexcept {
+        return h->sections[s].bytes;
+    }
+};
+
+}  // namespace Compiled
+
+#endif  // WFC_COMPILED_MODEL_HPP_
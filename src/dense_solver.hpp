@@ -0,0 +1,214 @@
+#ifndef WFC_DENSE_SOLVER_HPP_
+#define WFC_DENSE_SOLVER_HPP_
+
+#include "model.hpp"
+#include "solver.hpp"
+#include "utils/bitset.hpp"
+#include "wave.hpp"
+
+/**
+ * Dense (AC-3) solver: when a cell changes, each neighbor is intersected
+ * with the OR of the propagator rows of the patterns left in the cell, one
+ * 64-bit word (or SIMD vector of words) at a time. Keeps no per-pattern
+ * counters, so the wave is just the bitmap, counts and entropy memo.
+ */
+template <typename Index, typename Pattern>
+class DenseSolver final : public Solver {
+    const Model& model;
+
+    /** The wave, indicating which patterns can be put in which cell */
+    Wave<Index, Pattern> wave;
+
+    /** Cells whose bitmap changed since they were last propagated */
+    vector<Index> stack;
+    size_t stack_len = 0;
+    vector<bool> queued;
+
+    /** Scratch rows for the allowed and removed sets */
+    vector<uint64_t> allowed, removed;
+
+    struct BanItem {
+        Index index;
+        Pattern pattern;
+    };
+
+    /** Every ban since the first observation, only kept for backtracking */
+    vector<BanItem> trail;
+
+    /** Trail length and choice of every observation */
+    struct Level {
+        size_t trail_len;
+        Index index;
+        Pattern pattern;
+    };
+
+    vector<Level> levels;
+
+    /** Set as soon as a cell is left without patterns */
+    bool contradiction = false;
+
+    inline void empty(size_t index) {
+        contradiction = true;
+        stats.contradicted = index;
+    }
+
+    inline void push(size_t index) {
+        if (queued[index]) return;
+        queued[index] = true;
+        stack[stack_len++] = static_cast<Index>(index);
+    }
+
+    inline void record(size_t index, size_t p) {
+        if (levels.empty()) return;
+        trail.push_back({.index = static_cast<Index>(index),
+                         .pattern = static_cast<Pattern>(p)});
+    }
+
+    struct Snap : Snapshot {
+        typename Wave<Index, Pattern>::State wave;
+    };
+
+    inline void reset() {
+        std::fill(queued.begin(), queued.end(), false);
+        stack_len = 0;
+        trail.clear();
+        levels.clear();
+        contradiction = false;
+    }
+
+   public:
+    DenseSolver(const Model& model) noexcept
+        : model(model),
+          wave(model),
+          stack(model.L()),
+          queued(model.L()),
+          allowed(Bits::words(model.P)),
+          removed(Bits::words(model.P)) {}
+
+    void init(xoshiro256ss& rng) noexcept override {
+        wave.init(rng);
+        reset();
+    }
+
+    unique_ptr<Snapshot> snapshot() const override {
+        auto snap = std::make_unique<Snap>();
+        wave.save(snap->wave);
+        return snap;
+    }
+
+    void restore(const Snapshot& snapshot,
+                 xoshiro256ss& rng) noexcept override {
+        wave.load(static_cast<const Snap&>(snapshot).wave, rng);
+        reset();
+    }
+
+    void ban(size_t index, size_t p) noexcept override {
+        WFC_STAT(stats.bans++);
+        wave.ban(index, p);
+        if (!wave.count(index)) empty(index);
+        record(index, p);
+        push(index);
+    }
+
+    NOINLINE bool propagate() noexcept override {
+        const size_t W = wave.W;
+        const auto& propagator = model.propagator;
+
+        while (stack_len && !contradiction) {
+            if (cancelled()) return false;
+            WFC_STAT(stats.queue_peak = std::max(stats.queue_peak, stack_len));
+
+            const size_t i1 = stack[--stack_len];
+            queued[i1] = false;
+
+            const uint64_t* cell = wave.words(i1);
+
+            model.neighbors(i1, [&](size_t d, size_t i2) {
+                if (contradiction) return;
+                WFC_STAT(stats.decrements += wave.count(i1));
+                std::fill(allowed.begin(), allowed.end(), 0);
+                Bits::for_each(cell, W, [&](size_t p) {
+                    Bits::or_into(allowed.data(), propagator.row(p, d), W);
+                });
+
+                if (!Bits::restrict_to(wave.words(i2), allowed.data(),
+                                       removed.data(), W))
+                    return;
+
+                Bits::for_each(removed.data(), W, [&](size_t p) {
+                    wave.forget(i2, p);
+                    record(i2, p);
+                    WFC_STAT(stats.bans++);
+                });
+
+                if (!wave.count(i2)) empty(i2);
+                push(i2);
+            });
+        }
+
+        return !contradiction;
+    }
+
+    int64_t observe_next(xoshiro256ss& rng) noexcept override {
+        if (cancelled()) return -2;
+        return wave.observe_next(rng);
+    }
+
+    void observe(size_t index, xoshiro256ss& rng) noexcept override {
+        std::uniform_real_distribution<double> next_double(0.0, 1.0);
+        const size_t collapsed = wave.pick(index, next_double(rng));
+
+        if (model.backtracks) {
+            levels.push_back({.trail_len = trail.size(),
+                              .index = static_cast<Index>(index),
+                              .pattern = static_cast<Pattern>(collapsed)});
+        }
+
+        std::fill(removed.begin(), removed.end(), 0);
+        const size_t banned = wave.collapse(index, collapsed, removed.data());
+        WFC_STAT(stats.bans += banned);
+
+        Bits::for_each(removed.data(), wave.W,
+                       [&](size_t p) { record(index, p); });
+        if (banned) push(index);
+    }
+
+    bool backtrack() noexcept override {
+        if (levels.empty()) return false;
+
+        const Level level = levels.back();
+        levels.pop_back();
+
+        for (size_t k = 0; k < stack_len; k++) queued[stack[k]] = false;
+        stack_len = 0;
+
+        while (trail.size() > level.trail_len) {
+            const auto item = trail.back();
+            trail.pop_back();
+            wave.unban(item.index, item.pattern);
+            WFC_STAT(stats.restored++);
+        }
+
+        contradiction = false;
+        stats.backtracks++;
+
+        ban(level.index, level.pattern);
+        return true;
+    }
+
+    bool get(size_t index, size_t pattern) const noexcept override {
+        return wave.get(index, pattern);
+    }
+
+    const uint64_t* words(size_t index) const noexcept override {
+        return wave.words(index);
+    }
+
+    size_t bytes() const noexcept override {
+        return wave.bytes() + stack.capacity() * sizeof(Index) +
+               trail.capacity() * sizeof(BanItem) +
+               queued.size() / 8;
+    }
+};
+
+#endif  // WFC_DENSE_SOLVER_HPP_
@@ -0,0 +1,394 @@
+#ifndef WFC_MODEL_HPP_
+#define WFC_MODEL_HPP_
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <variant>
+#include <vector>
+
+#include "utils/array_2d.hpp"
+#include "utils/bitset.hpp"
+
+using std::vector;
+
+/** Type of heuristic used to choose next unobserved node **/
+enum class Heuristic { Entropy, MRV, Scanline };
+
+/**
+ * Propagation engine: Sparse walks the compatible lists with per-cell
+ * counters (AC-4), Dense intersects per-cell bitsets with the rows of a
+ * bit matrix propagator (AC-3). Auto picks by propagator density.
+ */
+enum class Engine { Auto, Sparse, Dense };
+
+/**
+ * Order of the cells in memory. RowMajor stores them x first, then y, then
+ * z. Tiled stores the grid in squares of Model::TILE cells a side, the
+ * squares and the cells of each one in row-major order, so the neighbors
+ * above and below a cell are TILE cells away instead of a row: on wide
+ * grids they share its pages, and often its cache lines. Voxel grids are
+ * stored in cubes of TILE cells a side the same way, which also brings the
+ * neighbors in z from a whole layer away to TILE * TILE cells.
+ */
+enum class Layout { RowMajor, Tiled };
+
+/**
+ * Sparse propagator: a flattened (direction, pattern) table of offset & length
+ * into one continuous list of compatible patterns.
+ */
+struct Propagator {
+    struct Entry {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    Array2D<Entry> table;
+
+    /**
+     * The compatible lists, packed into the narrowest pattern id type that
+     * can hold P (see pack).
+     */
+    std::variant<vector<uint8_t>, vector<uint16_t>, vector<uint32_t>> flat;
+
+    /** Fraction of compatible (pattern, direction, pattern) triples */
+    double density = 0;
+
+    /**
+     * Dense P x D x P bit matrix, only built for the dense engine: the row
+     * at (p * D + d) * words has the patterns compatible with p in direction
+     * d set.
+     */
+    vector<uint64_t> dense;
+    size_t words = 0;
+
+    Propagator() : table(0, 0){};
+
+    /** Build the dense bit matrix from the sparse lists */
+    inline void densify(size_t P) {
+        const size_t D = table.MX;
+        words = Bits::words(P);
+        dense = vector<uint64_t>(P * D * words, 0);
+
+        std::visit(
+            [&](const auto& list) {
+                for (size_t p = 0; p < P; p++) {
+                    for (size_t d = 0; d < D; d++) {
+                        uint64_t* r = row(p, d);
+                        const auto e = table.get(d, p);
+                        for (size_t k = e.offset; k < e.offset + e.length; k++)
+                            r[list[k] >> 6] |= uint64_t(1) << (list[k] & 63);
+                    }
+                }
+            },
+            flat);
+    }
+
+    inline uint64_t* row(size_t p, size_t d) {
+        return &dense[(p * table.MX + d) * words];
+    }
+    inline const uint64_t* row(size_t p, size_t d) const {
+        return &dense[(p * table.MX + d) * words];
+    }
+
+    template <typename T>
+    inline const vector<T>& list() const {
+        return std::get<vector<T>>(flat);
+    }
+
+    /**
+     * Bytes of the pattern id type of a model of P patterns. The solvers
+     * keep the pattern count of a cell in that type too, which can be P
+     * itself, so P has to fit, not only P - 1.
+     */
+    static inline constexpr size_t id_bytes(size_t P) noexcept {
+        return P <= UINT8_MAX ? 1 : P <= UINT16_MAX ? 2 : 4;
+    }
+
+    /** Narrow the pattern ids in wide to the id type of P (see id_bytes) */
+    inline void pack(const vector<uint32_t>& wide, size_t P) {
+        auto narrow = [&]<typename T>(T) {
+            flat = vector<T>(wide.begin(), wide.end());
+        };
+
+        if (id_bytes(P) == 1) {
+            narrow(uint8_t{});
+        } else if (id_bytes(P) == 2) {
+            narrow(uint16_t{});
+        } else {
+            flat = wide;
+        }
+    }
+
+    /** Largest compatible list, bounds the compatible counters */
+    inline uint32_t max_length() const {
+        uint32_t m = 0;
+        for (const auto& e : table.data) m = std::max(m, e.length);
+        return m;
+    }
+
+    inline size_t bytes() const {
+        return table.data.size() * sizeof(Entry) +
+               std::visit(
+                   [](const auto& v) { return v.size() * sizeof(v[0]); },
+                   flat) +
+               dense.size() * sizeof(dense[0]);
+    }
+};
+
+/**
+ * Immutable data of a WFC problem, shared by every run: grid dimensions,
+ * pattern weights and the propagator.
+ */
+struct Model {
+    inline constexpr static int8_t DX[] = {-1, 0, 1, 0, 0, 0};
+    inline constexpr static int8_t DY[] = {0, 1, 0, -1, 0, 0};
+    inline constexpr static int8_t DZ[] = {0, 0, 0, 0, 1, -1};
+    inline constexpr static uint8_t opposite[] = {2, 3, 0, 1, 5, 4};
+
+    /** Side of the squares (cubes for voxels) of Layout::Tiled */
+    inline constexpr static size_t TILE = 8;
+
+    /** Density from which Engine::Auto switches to the dense engine */
+    inline constexpr static double DENSE_THRESHOLD = 0.15;
+
+    size_t P = 0;
+    const size_t MX, MY, MZ, N;
+
+    const bool periodic;
+    const Heuristic heuristic;
+
+    /** Requested engine, resolved from Auto once the propagator is built */
+    Engine engine;
+
+    /**
+     * Maximum number of backtracks per run. 0 gives up on the first
+     * contradiction, letting the caller restart with another seed.
+     */
+    const uint32_t backtracks;
+
+    /** Order of the cells, Scanline observes them in that order */
+    const Layout layout;
+
+    /**
+     * Non periodic outputs: anchors closer than margin to the border are
+     * propagated but never observed, keeping the observed region extendable.
+     */
+    size_t margin = 0;
+
+    /** Distribution of the patterns as given in input */
+    vector<double> weights;
+    vector<double> wLogW;
+
+    double wSum = 0, wSumLogW = 0, e0 = 0;
+
+    /** The propagator, used to propagate the information in the wave */
+    Propagator propagator;
+
+    Model(size_t MX, size_t MY, size_t MZ, size_t N, bool periodic,
+          Heuristic heuristic, Engine engine = Engine::Auto,
+          uint32_t backtracks = 0, Layout layout = Layout::RowMajor) noexcept
+        : MX(MX),
+          MY(MY),
+          MZ(MZ),
+          N(N),
+          periodic(periodic),
+          heuristic(heuristic),
+          engine(engine),
+          backtracks(backtracks),
+          layout(layout) {}
+
+    /** L = total elements in the grid */
+    inline size_t L() const { return MX * MY * MZ; }
+
+    /** Number of directions stored in the propagator, 4 or 6 */
+    inline size_t D() const { return propagator.table.MX; }
+
+    /** Depth of the patterns, 1 unless they are voxels */
+    inline size_t NZ() const { return D() > 4 ? N : 1; }
+
+    /** Depth of the tiles of Layout::Tiled, squares being 1 deep */
+    inline size_t tile_depth() const { return MZ > 1 ? TILE : 1; }
+
+    /** Index of the cell at (x, y, z), see Layout */
+    inline size_t cell(size_t x, size_t y, size_t z = 0) const {
+        if (layout == Layout::RowMajor) return (z * MY + y) * MX + x;
+
+        // The tiles at the border are cut to w x h x d
+        const size_t tx = x - x % TILE, ty = y - y % TILE;
+        const size_t tz = z - z % tile_depth();
+        const size_t w = std::min(TILE, MX - tx), h = std::min(TILE, MY - ty);
+        const size_t d = std::min(tile_depth(), MZ - tz);
+        return tz * MX * MY + (ty * MX + tx * h) * d +
+               ((z - tz) * h + y - ty) * w + x - tx;
+    }
+
+    /** Coordinates {x, y, z} of cell index */
+    inline std::array<size_t, 3> coords(size_t index) const {
+        if (layout == Layout::RowMajor) {
+            const size_t z = index / (MX * MY);
+            index -= z * MX * MY;
+            return {index % MX, index / MX, z};
+        }
+
+        // Layers of tiles, then rows of tiles, then tiles
+        const size_t tz = index / (tile_depth() * MX * MY) * tile_depth();
+        const size_t d = std::min(tile_depth(), MZ - tz);
+        index -= tz * MX * MY;
+        const size_t ty = index / (TILE * MX * d) * TILE;
+        const size_t h = std::min(TILE, MY - ty);
+        index -= ty * MX * d;
+        const size_t tx = index / (TILE * h * d) * TILE;
+        const size_t w = std::min(TILE, MX - tx);
+        index -= tx * h * d;
+        return {tx + index % w, ty + index / w % h, tz + index / (w * h)};
+    }
+
+    /**
+     * Cells of a band, the contiguous runs of rows the striped solver
+     * splits the grid in: xy layers of voxel grids (TILE deep when Tiled),
+     * else rows of cells or of squares. The last band may be shorter.
+     */
+    inline size_t band() const {
+        if (layout == Layout::RowMajor) return MZ > 1 ? MX * MY : MX;
+        return MZ > 1 ? TILE * MX * MY : TILE * MX;
+    }
+
+    /**
+     * Offset from a cell to its neighbor in each direction, and to the one
+     * in the next square (Tiled) when the cell is on the side of a square.
+     * Per cell, a bit for every direction whose neighbor is at cross
+     * instead of stride, or WRAP if some neighbor is at neither (wrapped
+     * around, skipped when not periodic, or in a narrower square). See
+     * init_neighbors.
+     */
+    inline constexpr static uint8_t WRAP = 0x80;
+    int64_t stride[6] = {};
+    int64_t cross[6] = {};
+    vector<uint8_t> edges;
+
+    /**
+     * Call f(d, i2) for every neighbor i2 of cell index in direction d.
+     * Non periodic outputs skip neighbors a pattern can't be anchored at.
+     * Cells away from the edges, most of the grid, just add the strides.
+     */
+    template <typename F>
+    inline void neighbors(size_t index, const F& f) const {
+        const uint8_t e = edges[index];
+        if (!(e & WRAP)) {
+            auto next = [&](size_t d) {
+                return index + ((e >> d) & 1 ? cross[d] : stride[d]);
+            };
+            if (D() == 4) {
+                for (size_t d = 0; d < 4; d++) f(d, next(d));
+            } else {
+                for (size_t d = 0; d < 6; d++) f(d, next(d));
+            }
+            return;
+        }
+        wrapped_neighbors(index, f);
+    }
+
+    /** Same, for any cell, locating it in the grid */
+    template <typename F>
+    inline void wrapped_neighbors(size_t index, const F& f) const {
+        const auto [x, y, z] = coords(index);
+        neighbors_at(x, y, z, f);
+    }
+
+    /** Same, for the cell at (x1, y1, z1) */
+    template <typename F>
+    inline void neighbors_at(size_t x1, size_t y1, size_t z1,
+                             const F& f) const {
+        const size_t NZ = this->NZ();
+
+        for (size_t d = 0; d < D(); d++) {
+            int x2 = x1 + DX[d], y2 = y1 + DY[d], z2 = z1 + DZ[d];
+            if (!periodic && (x2 < 0 || y2 < 0 || z2 < 0 || x2 + N > MX ||
+                              y2 + N > MY || z2 + NZ > MZ))
+                continue;
+
+            x2 = (x2 + MX) % MX;
+            y2 = (y2 + MY) % MY;
+            if (NZ > 1) z2 = (z2 + MZ) % MZ;
+
+            f(d, cell(x2, y2, z2));
+        }
+    }
+
+    /** Compute the strides and edges, once D is known */
+    inline void init_neighbors() {
+        const int64_t T = TILE, X = MX, XY = X * MY;
+        const int64_t TZ = tile_depth(), TT = T * T;
+        for (size_t d = 0; d < D(); d++) {
+            if (layout == Layout::RowMajor) {
+                stride[d] = cross[d] = DX[d] + DY[d] * X + DZ[d] * XY;
+            } else {
+                // From a side of a full tile to the facing side of the
+                // next one: a tile further left or right, a row of tiles
+                // further up or down, a layer of tiles further in z
+                stride[d] = DX[d] + DY[d] * T + DZ[d] * TT;
+                cross[d] = DX[d] * (TT * TZ - T + 1) +
+                           DY[d] * (T * X * TZ - TT + T) +
+                           DZ[d] * (TZ * XY - TT * TZ + TT);
+            }
+        }
+
+        edges.resize(L());
+        for (size_t z = 0; z < MZ; z++) {
+            for (size_t y = 0; y < MY; y++) {
+                for (size_t x = 0; x < MX; x++) {
+                    const size_t index = cell(x, y, z);
+                    uint8_t bits = 0, seen = 0;
+                    neighbors_at(x, y, z, [&](size_t d, size_t i2) {
+                        seen |= 1 << d;
+                        if (i2 == index + stride[d]) return;
+                        bits |= i2 == index + cross[d] ? 1 << d : WRAP;
+                    });
+                    if (seen != (1 << D()) - 1) bits = WRAP;
+                    edges[index] = bits;
+                }
+            }
+        }
+    }
+
+    /** Compute the entropy constants from the weights */
+    inline void init_entropy() {
+        wSum = 0;
+        wSumLogW = 0;
+        e0 = 0;
+
+        if (heuristic != Heuristic::Entropy) return;
+
+        wLogW = vector<double>(P, 0);
+
+        for (size_t i = 0; i < P; i++) {
+            wLogW[i] = weights[i] * log(weights[i]);
+            wSum += weights[i];
+            wSumLogW += wLogW[i];
+        }
+
+        e0 = log(wSum) - wSumLogW / wSum;
+    }
+
+    /**
+     * Resolve Engine::Auto and build what the chosen engine needs, and the
+     * neighbor strides
+     */
+    inline void init_engine() {
+        if (engine == Engine::Auto) {
+            engine = propagator.density >= DENSE_THRESHOLD ? Engine::Dense
+                                                           : Engine::Sparse;
+        }
+        if (engine == Engine::Dense) propagator.densify(P);
+        init_neighbors();
+    }
+
+    inline size_t bytes() const {
+        return propagator.bytes() + weights.size() * sizeof(weights[0]) +
+               wLogW.size() * sizeof(wLogW[0]) + edges.size();
+    }
+};
+
+#endif  // WFC_MODEL_HPP_
@@ -3,15 +3,14 @@
 
 #include <algorithm>
 #include <array>
-#include <unordered_map>
 #include <vector>
 
 #include "utils/array_2d.hpp"
 #include "utils/helper.hpp"
+#include "utils/pattern_set.hpp"
 #include "wfc.hpp"
 
 using std::array;
-using std::unordered_map;
 using std::vector;
 
 /**
@@ -38,21 +37,34 @@ class OverlappingWFC : public WFC {
         size_t pattern_size;
 
         // heuristic used to pick next position to observe
-        Wave::Heuristic heuristic;
+        Heuristic heuristic;
 
         bool ground;  // True if the ground needs to be set (see init_ground).
+
+        // propagation engine, Auto picks by propagator density
+        Engine engine;
+
+        // backtracks allowed per run before giving up (0 = restart only)
+        uint32_t backtracks;
+
+        // order of the cells in memory, Tiled for very wide outputs
+        Layout layout = Layout::RowMajor;
+
+        // bits kept of each color channel of the input, fewer merge close
+        // colors (lowered further if the input has more than MAX_COLORS)
+        uint32_t channel_bits = 8;
     };
 
-   private:
+   protected:
     /**
      * Options needed by the algorithm.
      */
-    const Options &options;
+    const Options options;
     // Input ref
     const Array2D<uint32_t> &input;
 
     // Patterns
-    vector<vector<uint8_t>> patterns;
+    vector<vector<Color>> patterns;
     // Colors
     vector<uint32_t> colors;
 
@@ -63,114 +75,165 @@ class OverlappingWFC : public WFC {
      */
     OverlappingWFC(const Options &options, const Array2D<uint32_t> &input)
         : WFC(options.o_W, options.o_H, 1, options.pattern_size,
-              options.periodic_output, options.heuristic),
+              options.periodic_output, options.heuristic, options.engine,
+              options.backtracks, options.layout),
           options(options),
           input(input) {}
 
    protected:
     void init() noexcept override {
-        colors.clear();
+        const auto sample =
+            color_ords(input.data, options.channel_bits, colors);
 
-        auto sample = ords<uint8_t>(input.data, colors);
-        size_t C = colors.size();
+        if (colors.size() <= 256) {
+            extract(vector<uint8_t>(sample.begin(), sample.end()));
+        } else {
+            extract(vector<Color>(sample.begin(), sample.end()));
+        }
 
-        /*
-        for (int y = 0; y < input.MY; y++) {
-            for (int x = 0; x < input.MX; x++) {
-                fprintf(stderr, "%d", sample[x + y * input.MX]);
+        // p2 fits next to p1 in direction d iff the strip of p1 it overlaps
+        // equals its own strip facing p1, so strips are keyed once
+        const size_t S = N * N;
+        PatternSet strips((S - N) * sizeof(Color));
+        vector<Color> strip(S - N);
+        vector<uint32_t> keys(P * 4);
+
+        for (size_t p = 0; p < P; p++) {
+            for (uint8_t d = 0; d < 4; d++) {
+                const int dx = DX[d];
+                const int dy = DY[d];
+                size_t x0 = dx < 0 ? 0 : dx, x1 = dx < 0 ? dx + N : N;
+                size_t y0 = dy < 0 ? 0 : dy, y1 = dy < 0 ? dy + N : N;
+
+                size_t k = 0;
+                for (size_t y = y0; y < y1; y++)
+                    for (size_t x = x0; x < x1; x++)
+                        strip[k++] = patterns[p][x + N * y];
+
+                keys[p * 4 + d] =
+                    strips.add(reinterpret_cast<const uint8_t *>(strip.data()));
             }
-            fprintf(stderr, "\n");
         }
-        */
-
-        size_t W = 1;
-        for (int i = 0; i < N * N; i++) W *= C;
 
-        unordered_map<size_t, size_t> wtable;
-        vector<size_t> ordering;
+        from_keys(keys, strips.size());
+    }
 
+    /**
+     * Set the patterns and their weights from the sample, the input as color
+     * ordinals of type C
+     */
+    template <typename C>
+    void extract(const vector<C> &sample) {
+        const size_t S = N * N;
         size_t xmax =
             options.periodic_input ? options.i_W : options.i_W - N + 1;
         size_t ymax =
             options.periodic_input ? options.i_H : options.i_H - N + 1;
 
-        vector<uint8_t> temp(N * N);
-
-        for (size_t y = 0; y < ymax; y++) {
-            for (size_t x = 0; x < xmax; x++) {
-                Helper::pattern(temp, N, [&](size_t dx, size_t dy) {
-                    return sample[(x + dx) % options.i_W +
-                                  ((y + dy) % options.i_H) * options.i_W];
-                });
-
-                auto symmetries = Helper::squareSymmetries(
-                    temp,
-                    [&](auto &out, const auto &q) {
-                        Helper::rotated(q, out, N);
-                    },
-                    [&](auto &out, const auto &q) {
-                        Helper::reflected(q, out, N);
-                    },
-                    [](auto &, auto &) { return false; },
-                    (uint8_t)options.symmetry);
-
-                for (auto &p : symmetries) {
-                    size_t ind = 0, power = 1;
-                    for (int i = 0; i < p.size(); i++, power *= C)
-                        ind += p[p.size() - 1 - i] * power;
-
-                    if (!(wtable[ind]++)) ordering.push_back(ind);
-                }
+        // Blocks of rows are extracted in parallel, then merged in order
+        // which gives the pattern ids of a single pass
+        const size_t threads = build_pool ? build_pool->size() : 1;
+        const size_t blocks = std::max<size_t>(1, std::min(ymax, 4 * threads));
+
+        vector<PatternSet> sets(blocks, PatternSet(S * sizeof(C)));
+        vector<vector<C>> buffers(threads, vector<C>(8 * S));
+
+        auto extract = [&](size_t block, size_t worker) {
+            const size_t y0 = block * ymax / blocks;
+            const size_t y1 = (block + 1) * ymax / blocks;
+            C *sym = buffers[worker].data();
+
+            // Every sample uses N = 2 or 3, which get unrolled loops
+            if (N == 2) {
+                extract_rows<2>(sample, y0, y1, xmax, sets[block], sym);
+            } else if (N == 3) {
+                extract_rows<3>(sample, y0, y1, xmax, sets[block], sym);
+            } else {
+                extract_rows<0>(sample, y0, y1, xmax, sets[block], sym);
             }
-        }
+        };
 
-        P = wtable.size();
+        if (build_pool) {
+            build_pool->for_each(blocks, extract);
+        } else {
+            for (size_t b = 0; b < blocks; b++) extract(b, 0);
+        }
 
-        auto patternFromIndex = [&](size_t ind, vector<uint8_t> &result) {
-            size_t residue = ind, power = W;
-            for (size_t i = 0; i < result.size(); i++) {
-                power /= C;
-                size_t count = 0;
-                while (residue >= power) {
-                    residue -= power;
-                    count++;
-                }
-                result[i] = static_cast<uint8_t>(count);
-            }
-        };
+        for (size_t b = 1; b < blocks; b++) sets[0].merge(sets[b]);
 
-        patterns = vector<vector<uint8_t>>(P, vector<uint8_t>(N * N));
+        P = sets[0].size();
+        patterns.resize(P);
         weights.resize(P);
 
-        for (size_t counter = 0; counter < ordering.size(); counter++) {
-            size_t w = ordering[counter];
-            patternFromIndex(w, patterns[counter]);
-            weights[counter] = wtable[w];
+        for (size_t p = 0; p < P; p++) {
+            const C *pattern = reinterpret_cast<const C *>(sets[0][p]);
+            patterns[p].assign(pattern, pattern + S);
+            weights[p] = sets[0].count(p);
         }
+    }
 
-        // How compile this into inline version for fixed dx,dy, and N=2,3?
-        from_dense([&](uint32_t i1, uint32_t i2, uint8_t d) {
-            const int dx = DX[d];
-            const int dy = DY[d];
+    /**
+     * Add the patterns at rows [y0, y1) and columns [0, xmax) of the sample,
+     * with the symmetries in options, to set. sym is scratch of 8 patterns.
+     * K is N if known at compile time, else 0.
+     */
+    template <size_t K, typename C>
+    void extract_rows(const vector<C> &sample, size_t y0, size_t y1,
+                      size_t xmax, PatternSet &set, C *sym) const {
+        const size_t N = K ? K : this->N;
+        const size_t S = N * N;
+        const size_t W = options.i_W, H = options.i_H;
+
+        // Offsets of the pattern pixels, and the pixels its rotation and
+        // reflection read: constants once the loops are unrolled for a known
+        // N, else computed once instead of dividing by N
+        vector<uint32_t> table(K ? 0 : 4 * S);
+        for (uint32_t i = 0; i < table.size() / 4; i++) {
+            table[i] = i % N;
+            table[S + i] = i / N;
+            table[2 * S + i] = N - 1 - i / N + i % N * N;
+            table[3 * S + i] = N - 1 - i % N + i / N * N;
+        }
 
-            const vector<uint8_t> &p1 = patterns[i1];
-            const vector<uint8_t> &p2 = patterns[i2];
-            size_t xmin = dx < 0 ? 0 : dx, xmax = dx < 0 ? dx + N : N;
-            size_t ymin = dy < 0 ? 0 : dy, ymax = dy < 0 ? dy + N : N;
+        auto dx = [&](size_t i) { return K ? i % N : table[i]; };
+        auto dy = [&](size_t i) { return K ? i / N : table[S + i]; };
+        auto rot = [&](size_t i) {
+            return K ? N - 1 - i / N + i % N * N : table[2 * S + i];
+        };
+        auto ref = [&](size_t i) {
+            return K ? N - 1 - i % N + i / N * N : table[3 * S + i];
+        };
 
-            for (size_t y = ymin; y < ymax; y++)
-                for (size_t x = xmin; x < xmax; x++)
-                    if (p1[x + N * y] != p2[x - dx + N * (y - dy)])
-                        return false;
-            return true;
-        });
+        for (size_t y = y0; y < y1; y++) {
+            for (size_t x = 0; x < xmax; x++) {
+                for (size_t i = 0; i < S; i++) {
+                    size_t sx = x + dx(i), sy = y + dy(i);
+                    if (sx >= W) sx -= W;
+                    if (sy >= H) sy -= H;
+                    sym[i] = sample[sx + sy * W];
+                }
+
+                Helper::squareSymmetries(sym, S, rot, ref);
+
+                for (uint8_t i = 0; i < 8; i++) {
+                    if (!((options.symmetry >> i) & 1)) continue;
+                    const auto *bytes =
+                        reinterpret_cast<const uint8_t *>(sym + i * S);
+                    if constexpr (K) {
+                        set.add<K * K * sizeof(C)>(bytes);
+                    } else {
+                        set.add(bytes);
+                    }
+                }
+            }
+        }
     }
 
-    bool clear() noexcept override {
+    bool clear(Solver &s) noexcept override {
         if (options.ground) {
             for (size_t x = 0; x < MX; x++) {
-                for (size_t p = 0; p < P - 1; p++) ban(x + (MY - 1) * MX, p);
-                for (size_t y = 0; y < MY - 1; y++) ban(x + y * MX, P - 1);
+                for (size_t p = 0; p < P - 1; p++) s.ban(cell(x, MY - 1), p);
+                for (size_t y = 0; y < MY - 1; y++) s.ban(cell(x, y), P - 1);
             }
 
             return true;
@@ -179,42 +242,138 @@ class OverlappingWFC : public WFC {
     }
 
    public:
+    /**
+     * Key of the compiled model of an input: its pixels and the options the
+     * patterns depend on. The output options don't change the model, so
+     * one file serves every output size and heuristic.
+     */
+    static uint64_t key(const Options &options,
+                        const Array2D<uint32_t> &input) noexcept {
+        const uint64_t fields[] = {
+            PatternSet::hash((const uint8_t *)input.data.data(),
+                             input.data.size() * sizeof(uint32_t)),
+            input.MX,
+            input.MY,
+            options.periodic_input,
+            options.symmetry,
+            options.pattern_size,
+            options.channel_bits};
+        return PatternSet::hash((const uint8_t *)fields, sizeof(fields));
+    }
+
+    /** Build the model if needed and write it as a compiled model */
+    bool save(const std::string &path) {
+        build();
+
+        // Color ordinals take one byte, or two past 256 colors
+        const size_t S = N * N;
+        const size_t width = colors.size() <= 256 ? 1 : sizeof(Color);
+        vector<uint8_t> packed(P * S * width);
+        for (size_t p = 0; p < P; p++)
+            for (size_t i = 0; i < S; i++)
+                for (size_t b = 0; b < width; b++)
+                    packed[(p * S + i) * width + b] = patterns[p][i] >> 8 * b;
+
+        return save_model(path, key(options, input),
+                          {packed.data(), packed.size()}, S * width,
+                          {colors.data(), colors.size() * sizeof(uint32_t)});
+    }
+
+    /**
+     * Take the model from a compiled model instead of building it. Must be
+     * called before the first run; returns false, leaving the model to be
+     * built as usual, if the file is missing, outdated or of another input.
+     */
+    bool load(const std::string &path) {
+        using namespace Compiled;
+
+        File file(path, key(options, input));
+        if (!file) return false;
+
+        const size_t S = N * N;
+        const Header &h = file.header();
+        const size_t width = h.pattern_bytes / S;
+        if ((width != 1 && width != sizeof(Color)) ||
+            h.pattern_bytes != S * width ||
+            file.bytes(Patterns) != h.P * h.pattern_bytes ||
+            file.bytes(Colors) % sizeof(uint32_t) || !load_model(file))
+            return false;
+
+        const uint8_t *packed = file.section(Patterns);
+        patterns.assign(P, vector<Color>(S, 0));
+        for (size_t p = 0; p < P; p++)
+            for (size_t i = 0; i < S; i++)
+                for (size_t b = 0; b < width; b++)
+                    patterns[p][i] |= packed[(p * S + i) * width + b] << 8 * b;
+
+        colors.resize(file.bytes(Colors) / sizeof(uint32_t));
+        memcpy(colors.data(), file.section(Colors), file.bytes(Colors));
+        return true;
+    }
+
+    using Image = Array2D<array<uint8_t, 3>>;
+
     /**
      * Transform the wave to a valid output (a 2d array of patterns that
      * aren't in contradiction). This function should be used only when all
      * cell of the wave are defined.
      */
-    Array2D<array<uint8_t, 3>> get_output() const noexcept {
-        Array2D<array<uint8_t, 3>> out(MX, MY);
+    Image get_output() const noexcept {
+        Image out(MX, MY);
+        get_output(*output, out);
+        return out;
+    }
 
-        bool sus = false;
+    /**
+     * Like generate_batch, handing f(const BatchResult&, const Image&) the
+     * output of each seed (only meaningful on success) in a buffer owned by
+     * the worker thread and reused for its next seeds.
+     */
+    template <typename F>
+    void generate_images(const vector<uint32_t> &seeds, ThreadPool &pool,
+                         const F &f, int32_t limit = -1) {
+        vector<Image> images(pool.size(), Image(MX, MY));
+
+        generate_batch(
+            seeds, pool,
+            [&](const BatchResult &r) {
+                if (r.success) get_output(r.solver, images[r.worker]);
+                f(r, images[r.worker]);
+            },
+            limit);
+    }
 
-        for (size_t y = 0; y < MY; y++) {
-            int dy = y < MY - N + 1 ? 0 : N - 1;
+    /**
+     * Color index of output pixel (x, y), read from the first pattern left in
+     * the cell it is anchored in. sus is set if that cell is empty.
+     */
+    inline Color color_index(const Solver &s, size_t x, size_t y,
+                             bool &sus) const noexcept {
+        int dy = y < MY - N + 1 ? 0 : N - 1;
+        int dx = x < MX - N + 1 ? 0 : N - 1;
 
-            for (size_t x = 0; x < MX; x++) {
-                int dx = x < MX - N + 1 ? 0 : N - 1;
+        int64_t ob = Bits::first(s.words(cell(x - dx, y - dy)), Bits::words(P));
 
-                int ob = -1;
-                for (int p = 0; p < P; p++) {
-                    if (wave->get(x - dx + (y - dy) * MX, p)) {
-                        ob = p;
-                        break;
-                    }
-                }
+        if (ob < 0) {
+            ob = 0;
+            sus = true;
+        }
 
-                if (ob < 0) {
-                    ob = 0;
-                    sus = true;
-                }
+        return patterns[ob][dx + dy * N];
+    }
+
+    static inline array<uint8_t, 3> rgb(uint32_t color) noexcept {
+        return {uint8_t((color >> 16) & 0xFF), uint8_t((color >> 8) & 0xFF),
+                uint8_t(color & 0xFF)};
+    }
 
-                auto &pattern = patterns[ob];
-                uint32_t colorIndex = pattern[dx + dy * N];
-                uint32_t color = colors[colorIndex];
+    /** Write the output of a solver into out, sized MX x MY */
+    void get_output(const Solver &s, Image &out) const noexcept {
+        bool sus = false;
 
-                out.set(x, y,
-                        {uint8_t((color >> 16) & 0xFF),
-                         uint8_t((color >> 8) & 0xFF), uint8_t(color & 0xFF)});
+        for (size_t y = 0; y < MY; y++) {
+            for (size_t x = 0; x < MX; x++) {
+                out.set(x, y, rgb(colors[color_index(s, x, y, sus)]));
             }
         }
 
@@ -222,8 +381,6 @@ class OverlappingWFC : public WFC {
             std::cerr << "get_output() called on contradicted wfc(overlap)"
                       << std::endl;
         }
-
-        return out;
     };
 };
 
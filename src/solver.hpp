@@ -0,0 +1,93 @@
+#ifndef WFC_SOLVER_HPP_
+#define WFC_SOLVER_HPP_
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <random>
+
+#include "model.hpp"
+#include "stats.hpp"
+#include "utils/xoshiro256ss.hpp"
+
+using std::unique_ptr;
+using std::vector;
+
+#ifdef WIN32
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
+/**
+ * Per-run state of the WFC algorithm, with the integer widths erased.
+ * Use make_solver to get the narrowest instantiation fitting a model.
+ */
+class Solver {
+   public:
+    Stats stats;
+
+    /** Where attempts log their steps, if anywhere */
+    Trace* trace = nullptr;
+
+    /** Set by another thread to abort propagate and observe_next */
+    const std::atomic<bool>* cancel = nullptr;
+
+    inline bool cancelled() const {
+        return cancel && cancel->load(std::memory_order_relaxed);
+    }
+
+    virtual ~Solver() = default;
+
+    /** Reset the wave to every cell being able to have every pattern */
+    virtual void init(xoshiro256ss& rng) noexcept = 0;
+
+    /** Copy of the state of a solver, that solvers of the same model load */
+    struct Snapshot {
+        virtual ~Snapshot() = default;
+    };
+
+    /** Save the current (fully propagated) state */
+    virtual unique_ptr<Snapshot> snapshot() const = 0;
+
+    /**
+     * Reset to a snapshot taken by a solver of the same model, instead of
+     * init and re-propagating the initial constraints.
+     */
+    virtual void restore(const Snapshot& snapshot,
+                         xoshiro256ss& rng) noexcept = 0;
+
+    /** Ban pattern p in cell index and queue it for propagation */
+    virtual void ban(size_t index, size_t p) noexcept = 0;
+
+    /** Propagate the queued bans, return false on contradiction */
+    virtual bool propagate() noexcept = 0;
+
+    /** See Wave::observe_next, -2 if cancelled */
+    virtual int64_t observe_next(xoshiro256ss& rng) noexcept = 0;
+
+    /**
+     * Collapse cell index to one of its remaining patterns. Opens a new
+     * decision level when the model allows backtracking.
+     */
+    virtual void observe(size_t index, xoshiro256ss& rng) noexcept = 0;
+
+    /**
+     * Undo every ban since the last observation and ban the pattern it
+     * chose instead. Return false if there is no decision left to undo.
+     */
+    virtual bool backtrack() noexcept = 0;
+
+    /** Return true if pattern can be placed in cell index */
+    virtual bool get(size_t index, size_t pattern) const noexcept = 0;
+
+    /**
+     * Patterns that can be placed in cell index, as Bits::words(P) words,
+     * valid until the solver next changes
+     */
+    virtual const uint64_t* words(size_t index) const noexcept = 0;
+
+    virtual size_t bytes() const noexcept = 0;
+};
+
+#endif  // WFC_SOLVER_HPP_
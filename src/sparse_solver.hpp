@@ -0,0 +1,296 @@
+#ifndef WFC_SPARSE_SOLVER_HPP_
+#define WFC_SPARSE_SOLVER_HPP_
+
+#include <cstring>
+
+#include "model.hpp"
+#include "solver.hpp"
+#include "utils/array_3d.hpp"
+#include "utils/bitset.hpp"
+#include "wave.hpp"
+
+/**
+ * Sparse (AC-4) solver: every cell keeps a counter of compatible patterns per
+ * (direction, pattern), decremented while walking the propagator lists.
+ * Counters are exact (banned patterns keep being decremented), so undoing a
+ * propagated ban is walking the same lists and incrementing them back.
+ *
+ * Bans are queued per cell: a cell waits in the queue at most once, with the
+ * patterns removed since it was last visited, and its neighbors are then
+ * updated for all of them at once.
+ */
+template <typename Index, typename Pattern, typename Counter>
+class SparseSolver final : public Solver {
+    const Model& model;
+
+    /** The wave, indicating which patterns can be put in which cell */
+    Wave<Index, Pattern> wave;
+
+    /** Counter of pattern compatbility */
+    Array3D<Counter> compatible;
+
+    /** Propagator lists, narrowed to Pattern */
+    const vector<Pattern>& flat;
+
+    /**
+     * Patterns banned in each cell whose supports are not yet removed from
+     * the neighbors, W words per cell
+     */
+    vector<uint64_t> removed;
+
+    /** Cells with removed patterns, in a ring of L, and its scratch row */
+    vector<Index> queue;
+    size_t front = 0, queue_len = 0;
+    vector<bool> queued;
+    vector<uint64_t> visit;
+
+    struct BanItem {
+        Index index;
+        Pattern pattern;
+    };
+
+    /** Every ban since the first observation, only kept for backtracking */
+    vector<BanItem> trail;
+
+    /** Trail length and choice of every observation */
+    struct Level {
+        size_t trail_len;
+        Index index;
+        Pattern pattern;
+    };
+
+    vector<Level> levels;
+
+    bool contradiction = false;
+
+    inline void enqueue(size_t index) {
+        if (queued[index]) return;
+        queued[index] = true;
+        size_t back = front + queue_len++;
+        queue[back < queue.size() ? back : back - queue.size()] =
+            static_cast<Index>(index);
+    }
+
+    inline void push(size_t index, size_t p) {
+        WFC_STAT(stats.bans++);
+        wave.ban(index, p);
+        if (!wave.count(index)) {
+            contradiction = true;
+            stats.contradicted = index;
+        }
+
+        Bits::set(&removed[index * wave.W], p);
+        enqueue(index);
+
+        if (!levels.empty()) {
+            trail.push_back({.index = static_cast<Index>(index),
+                             .pattern = static_cast<Pattern>(p)});
+        }
+    }
+
+    /**
+     * Walk the propagator lists of the patterns set in bits, banned in cell
+     * index, and add delta to the compatible counters of the neighbors.
+     * Call f(p2, i2) on each counter that drops to 0.
+     */
+    template <int delta, typename F>
+    inline void supports(size_t index, const uint64_t* bits, const F& f) {
+        const auto& table = model.propagator.table;
+
+        model.neighbors(index, [&](size_t d, size_t i2) {
+            Bits::for_each(bits, wave.W, [&](size_t p) {
+                const auto entry = table.get(d, p);
+                WFC_STAT(if constexpr (delta < 0) stats.decrements +=
+                         entry.length);
+
+                for (size_t pattern_index = entry.offset;
+                     pattern_index < entry.offset + entry.length;
+                     pattern_index++) {
+                    const auto p2 = flat[pattern_index];
+                    auto& c = compatible.ref(d, p2, i2);
+                    c += delta;
+                    if (delta < 0 && !c) f(p2, i2);
+                }
+            });
+        });
+    }
+
+    /** Empty the queue, dropping the removed patterns it was holding */
+    inline void drain() {
+        for (; queue_len; queue_len--) {
+            const Index index = queue[front];
+            if (++front == queue.size()) front = 0;
+            queued[index] = false;
+            std::fill_n(&removed[index * wave.W], wave.W, 0);
+        }
+        front = 0;
+    }
+
+    /** Counters of a cell with every pattern, broadcast by init */
+    vector<Counter> cell;
+
+    struct Snap : Snapshot {
+        typename Wave<Index, Pattern>::State wave;
+        vector<Counter> compatible;
+    };
+
+    inline void reset() {
+        drain();
+        trail.clear();
+        levels.clear();
+        contradiction = false;
+    }
+
+   public:
+    SparseSolver(const Model& model) noexcept
+        : model(model),
+          wave(model),
+          compatible(model.D(), model.P, model.L()),
+          flat(model.propagator.list<Pattern>()),
+          removed(model.L() * Bits::words(model.P)),
+          queue(model.L()),
+          queued(model.L()),
+          visit(Bits::words(model.P)),
+          cell(model.D() * model.P) {
+        for (size_t p = 0; p < model.P; p++) {
+            for (size_t d = 0; d < model.D(); d++) {
+                cell[d + p * model.D()] =
+                    model.propagator.table.get(Model::opposite[d], p).length;
+            }
+        }
+    }
+
+    void init(xoshiro256ss& rng) noexcept override {
+        wave.init(rng);
+
+        // compatible is cell-major, every cell starts as a copy of cell
+        Counter* c = compatible.data.data();
+        for (size_t i = 0; i < model.L(); i++, c += cell.size()) {
+            memcpy(c, cell.data(), cell.size() * sizeof(Counter));
+        }
+
+        reset();
+    }
+
+    unique_ptr<Snapshot> snapshot() const override {
+        auto snap = std::make_unique<Snap>();
+        wave.save(snap->wave);
+        snap->compatible = compatible.data;
+        return snap;
+    }
+
+    void restore(const Snapshot& snapshot,
+                 xoshiro256ss& rng) noexcept override {
+        const auto& snap = static_cast<const Snap&>(snapshot);
+        wave.load(snap.wave, rng);
+        std::copy(snap.compatible.begin(), snap.compatible.end(),
+                  compatible.data.begin());
+        reset();
+    }
+
+    void ban(size_t index, size_t p) noexcept override { push(index, p); }
+
+    NOINLINE bool propagate() noexcept override {
+        const size_t W = wave.W;
+
+        while (queue_len && !contradiction) {
+            if (cancelled()) return false;
+            WFC_STAT(stats.queue_peak = std::max(stats.queue_peak, queue_len));
+
+            const size_t i1 = queue[front];
+            if (++front == queue.size()) front = 0;
+            queue_len--;
+            queued[i1] = false;
+
+            uint64_t* row = &removed[i1 * W];
+            std::copy_n(row, W, visit.data());
+            std::fill_n(row, W, 0);
+
+            supports<-1>(i1, visit.data(), [&](size_t p2, size_t i2) {
+                if (wave.get(i2, p2)) push(i2, p2);
+            });
+        }
+
+        return !contradiction;
+    }
+
+    int64_t observe_next(xoshiro256ss& rng) noexcept override {
+        if (cancelled()) return -2;
+        return wave.observe_next(rng);
+    }
+
+    void observe(size_t index, xoshiro256ss& rng) noexcept override {
+        std::uniform_real_distribution<double> next_double(0.0, 1.0);
+        const size_t collapsed = wave.pick(index, next_double(rng));
+
+        if (model.backtracks) {
+            levels.push_back({.trail_len = trail.size(),
+                              .index = static_cast<Index>(index),
+                              .pattern = static_cast<Pattern>(collapsed)});
+
+            Bits::for_each(wave.words(index), wave.W, [&](size_t p) {
+                if (p != collapsed) {
+                    trail.push_back({.index = static_cast<Index>(index),
+                                     .pattern = static_cast<Pattern>(p)});
+                }
+            });
+        }
+
+        // Every other pattern goes at once, the cell queued a single time
+        const size_t banned =
+            wave.collapse(index, collapsed, &removed[index * wave.W]);
+        WFC_STAT(stats.bans += banned);
+        if (banned) enqueue(index);
+    }
+
+    bool backtrack() noexcept override {
+        if (levels.empty()) return false;
+
+        const Level level = levels.back();
+        levels.pop_back();
+
+        // The queue was empty when the level was opened, so every ban still
+        // in it comes after and only needs to be forgotten
+        const size_t W = wave.W;
+        while (trail.size() > level.trail_len) {
+            const auto item = trail.back();
+            trail.pop_back();
+
+            uint64_t* row = &removed[item.index * W];
+            if (Bits::test(row, item.pattern)) {
+                Bits::reset(row, item.pattern);
+            } else {
+                std::fill(visit.begin(), visit.end(), 0);
+                Bits::set(visit.data(), item.pattern);
+                supports<1>(item.index, visit.data(), [](size_t, size_t) {});
+            }
+            wave.unban(item.index, item.pattern);
+            WFC_STAT(stats.restored++);
+        }
+
+        drain();
+        contradiction = false;
+        stats.backtracks++;
+
+        push(level.index, level.pattern);
+        return true;
+    }
+
+    bool get(size_t index, size_t pattern) const noexcept override {
+        return wave.get(index, pattern);
+    }
+
+    const uint64_t* words(size_t index) const noexcept override {
+        return wave.words(index);
+    }
+
+    size_t bytes() const noexcept override {
+        return wave.bytes() +
+               compatible.data.size() * sizeof(compatible.data[0]) +
+               removed.size() * sizeof(uint64_t) +
+               queue.size() * sizeof(Index) + queued.size() / 8 +
+               trail.capacity() * sizeof(BanItem);
+    }
+};
+
+#endif  // WFC_SPARSE_SOLVER_HPP_
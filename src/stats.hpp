@@ -0,0 +1,152 @@
+#ifndef WFC_STATS_HPP_
+#define WFC_STATS_HPP_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+
+/**
+ * Counters and phase timers of the solvers. Define WFC_STATS to 0 to compile
+ * them out of the hot paths, leaving only what the algorithm itself needs
+ * (the backtrack count).
+ */
+#ifndef WFC_STATS
+#define WFC_STATS 1
+#endif
+
+#if WFC_STATS
+#define WFC_STAT(...) __VA_ARGS__
+#else
+#define WFC_STAT(...)
+#endif
+
+/**
+ * Timestamp counter: cycles on x86, nanoseconds elsewhere. Only differences
+ * are meaningful, see Stats::ms to convert them.
+ */
+inline uint64_t ticks() noexcept {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+}
+
+/** Statistics of the last run */
+struct Stats {
+    size_t backtracks = 0;       // Contradictions undone by backtracking
+    size_t restored = 0;         // Bans undone by backtracking
+    uint64_t restore_ticks = 0;  // Time spent undoing bans
+
+    int64_t contradicted = -1;     // Cell of the last contradiction, or -1
+    int64_t contradicted_at = -1;  // Observations made before it
+
+    size_t observations = 0;  // Cells collapsed
+    size_t bans = 0;          // Patterns removed, observed or propagated
+    size_t decrements = 0;    // Supports removed (dense: rows merged)
+    size_t queue_peak = 0;    // Most bans or cells waiting to propagate
+    size_t propagations = 0;  // Calls to propagate after an observation
+    size_t largest_wave = 0;  // Most bans done by one of them
+
+    uint64_t init_ticks = 0;       // Time spent resetting the wave
+    uint64_t select_ticks = 0;     // Time spent picking cells to observe
+    uint64_t observe_ticks = 0;    // Time spent collapsing them
+    uint64_t propagate_ticks = 0;  // Time spent propagating
+
+    /** Convert ticks to milliseconds, calibrated once on first use */
+    static double ms(uint64_t t) noexcept {
+        using clock = std::chrono::steady_clock;
+        static const double per_ms = [] {
+            const auto start = clock::now();
+            const uint64_t t0 = ticks();
+            while (clock::now() - start < std::chrono::milliseconds(5)) {
+            }
+            const uint64_t t1 = ticks();
+            return (t1 - t0) / std::chrono::duration<double, std::milli>(
+                                   clock::now() - start)
+                                   .count();
+        }();
+        return t / per_ms;
+    }
+
+    inline double restore_ms() const noexcept { return ms(restore_ticks); }
+    inline double init_ms() const noexcept { return ms(init_ticks); }
+    inline double select_ms() const noexcept { return ms(select_ticks); }
+    inline double observe_ms() const noexcept { return ms(observe_ticks); }
+    inline double propagate_ms() const noexcept {
+        return ms(propagate_ticks);
+    }
+    inline double total_ms() const noexcept {
+        return ms(init_ticks + select_ticks + observe_ticks +
+                  propagate_ticks + restore_ticks);
+    }
+};
+
+/**
+ * Ring buffer of the last steps of runs, kept when a solver is given one
+ * (and WFC_STATS is on). Capacity is rounded up to a power of two.
+ */
+class Trace {
+   public:
+    enum class Kind : uint8_t {
+        Observe,        // index: cell collapsed
+        Propagate,      // value: bans it did
+        Contradiction,  // index: cell left empty, value: bans before
+        Backtrack,      // value: backtracks so far
+    };
+
+    struct Event {
+        uint64_t ticks;  // See ::ticks, when the step ended
+        uint32_t step;   // Observation the step belongs to
+        Kind kind;
+        uint32_t index;  // Cell, if any
+        uint64_t value;
+    };
+
+   private:
+    std::vector<Event> events;
+    size_t mask;
+    size_t pushed = 0;
+
+   public:
+    explicit Trace(size_t capacity = 4096) noexcept {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        events.resize(size);
+        mask = size - 1;
+    }
+
+    inline void push(Kind kind, uint32_t step, uint32_t index = 0,
+                     uint64_t value = 0) noexcept {
+        events[pushed++ & mask] = {.ticks = ticks(),
+                                   .step = step,
+                                   .kind = kind,
+                                   .index = index,
+                                   .value = value};
+    }
+
+    inline void clear() noexcept { pushed = 0; }
+
+    /** Number of events kept, the oldest being overwritten */
+    inline size_t size() const noexcept {
+        return pushed < events.size() ? pushed : events.size();
+    }
+
+    /** Call f(const Event&) on the kept events, oldest first */
+    template <typename F>
+    void for_each(const F& f) const {
+        for (size_t k = pushed - size(); k < pushed; k++) f(events[k & mask]);
+    }
+};
+
+#endif  // WFC_STATS_HPP_
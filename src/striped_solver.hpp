@@ -0,0 +1,485 @@
+#ifndef WFC_STRIPED_SOLVER_HPP_
+#define WFC_STRIPED_SOLVER_HPP_
+
+#include <atomic>
+#include <thread>
+
+#include "model.hpp"
+#include "solver.hpp"
+#include "utils/bitset.hpp"
+#include "utils/thread_pool.hpp"
+#include "wave.hpp"
+
+/** Solver that can also observe and propagate across a thread pool */
+class ParallelSolver : public Solver {
+   public:
+    /**
+     * Propagate the queued bans and observe until every cell is decided,
+     * return false on contradiction. Never backtracks.
+     */
+    virtual bool solve(ThreadPool& pool) noexcept = 0;
+};
+
+/**
+ * Domain-decomposed solver for very large single outputs. The grid is split
+ * in K horizontal stripes of at least N rows, each with its own wave,
+ * propagation stack and observation order, owned by one thread at a time.
+ * Voxel grids are split along z instead, a row then being an xy layer, and
+ * Layout::Tiled grids in rows of squares (see Model::band).
+ *
+ * Propagation is the dense (AC-3) one. When a cell on the first or last row
+ * of a stripe changes, its bitmap is published to an edge buffer and its
+ * index posted to the neighbor stripe's single producer mailbox (once, until
+ * the neighbor reads it). A global count of messages in flight and stripes
+ * with queued cells tells when every stripe is quiescent.
+ *
+ * Rounds alternate between the even and odd stripes, each one observing
+ * one cell, so cells observed together are a whole stripe (N rows) apart.
+ * Domains only shrink, so propagation reaches the same fixpoint whatever
+ * the thread interleaving. In deterministic mode it also runs in
+ * supersteps: stripes only read the messages posted before the superstep,
+ * and publish their edges after it, so the result only depends on K.
+ */
+template <typename Index, typename Pattern>
+class StripedSolver final : public ParallelSolver {
+    const Model& model;
+    /** Cells per row (see Model::band), and words per cell */
+    const size_t stride, W;
+    const bool deterministic;
+
+    /** Single producer, single consumer ring of cell indices */
+    struct Mailbox {
+        // A cell is never posted twice before being read, a row is enough
+        vector<Index> ring;
+        std::atomic<size_t> head = 0, tail = 0;
+
+        inline void push(Index index) {
+            const size_t t = tail.load(std::memory_order_relaxed);
+            ring[t % ring.size()] = index;
+            tail.store(t + 1, std::memory_order_release);
+        }
+
+        inline bool pop(Index& index, size_t limit) {
+            const size_t h = head.load(std::memory_order_relaxed);
+            if (h == limit) return false;
+            index = ring[h % ring.size()];
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+    };
+
+    struct Stripe {
+        /** Rows [y0, y1), the cells of wave */
+        size_t y0, y1;
+        Wave<Index, Pattern> wave;
+        xoshiro256ss rng;
+        bool finished = false;
+
+        /**
+         * Cells whose bitmap changed since they were last propagated,
+         * active while it is not empty.
+         */
+        vector<Index> stack;
+        size_t stack_len = 0;
+        vector<bool> queued;
+        bool active = false;
+
+        /** Scratch rows for the allowed and removed sets, and a neighbor */
+        vector<uint64_t> allowed, removed, cell;
+
+        /**
+         * Last published bitmap of the first (side 0) and last (side 1)
+         * row, and whether it is posted and not read yet.
+         */
+        std::unique_ptr<std::atomic<uint64_t>[]> edge;
+        std::unique_ptr<std::atomic<bool>[]> posted;
+
+        /** From the stripe above (0) and below (1), and read limits */
+        Mailbox inbox[2];
+        size_t limit[2];
+
+        /** Deterministic mode: edge cells to publish after the superstep */
+        vector<Index> outbox;
+
+        Stripe(const Model& model, size_t stride, size_t y0, size_t y1)
+            : y0(y0),
+              y1(y1),
+              wave(model, y0 * stride, std::min(y1 * stride, model.L())),
+              stack(wave.L),
+              queued(wave.L),
+              allowed(Bits::words(model.P)),
+              removed(Bits::words(model.P)),
+              cell(Bits::words(model.P)),
+              edge(new std::atomic<uint64_t>[2 * stride *
+                                              Bits::words(model.P)]),
+              posted(new std::atomic<bool>[2 * stride]) {
+            inbox[0].ring.resize(stride);
+            inbox[1].ring.resize(stride);
+        }
+    };
+
+    vector<unique_ptr<Stripe>> stripes;
+    /** Stripe of every row */
+    vector<uint32_t> owner;
+
+    /** Messages in flight plus stripes with queued cells */
+    std::atomic<size_t> pending = 0;
+    std::atomic<bool> contradiction = false;
+
+    inline void push(Stripe& st, size_t index) {
+        const size_t local = index - st.wave.begin;
+        if (st.queued[local]) return;
+        st.queued[local] = true;
+        st.stack[st.stack_len++] = static_cast<Index>(index);
+
+        if (st.active) return;
+        st.active = true;
+        pending.fetch_add(1);
+    }
+
+    /** Restrict cell i2 of st to what the bitmap cell allows in direction d */
+    inline void restrict(Stripe& st, const uint64_t* cell, size_t d,
+                         size_t i2) {
+        const auto& propagator = model.propagator;
+
+        std::fill(st.allowed.begin(), st.allowed.end(), 0);
+        Bits::for_each(cell, W, [&](size_t p) {
+            Bits::or_into(st.allowed.data(), propagator.row(p, d), W);
+        });
+
+        if (!Bits::restrict_to(st.wave.words(i2), st.allowed.data(),
+                               st.removed.data(), W))
+            return;
+
+        Bits::for_each(st.removed.data(), W,
+                       [&](size_t p) { st.wave.forget(i2, p); });
+
+        if (!st.wave.count(i2)) {
+            contradiction.store(true, std::memory_order_relaxed);
+        }
+        push(st, i2);
+    }
+
+    inline size_t above(size_t s) const {
+        return s ? s - 1 : stripes.size() - 1;
+    }
+    inline size_t below(size_t s) const {
+        return s + 1 < stripes.size() ? s + 1 : 0;
+    }
+
+    /** Copy the bitmap of edge cell i1 of stripe s and post it */
+    inline void publish(size_t s, size_t i1) {
+        Stripe& st = *stripes[s];
+        const size_t side = i1 / stride == st.y0 ? 0 : 1;
+        const size_t slot = side * stride + i1 % stride;
+
+        const uint64_t* bits = st.wave.words(i1);
+        for (size_t w = 0; w < W; w++) {
+            st.edge[slot * W + w].store(bits[w], std::memory_order_relaxed);
+        }
+
+        if (st.posted[slot].exchange(true, std::memory_order_acq_rel)) return;
+
+        pending.fetch_add(1);
+        if (side == 0) {
+            stripes[above(s)]->inbox[1].push(i1);
+        } else {
+            stripes[below(s)]->inbox[0].push(i1);
+        }
+    }
+
+    /** Propagate cell i1 of stripe s to its neighbors */
+    inline void propagate_cell(size_t s, size_t i1) {
+        Stripe& st = *stripes[s];
+        const uint64_t* cell = st.wave.words(i1);
+        bool edge = false;
+
+        model.neighbors(i1, [&](size_t d, size_t i2) {
+            if (owner[i2 / stride] != s) {
+                edge = true;
+                return;
+            }
+            restrict(st, cell, d, i2);
+        });
+
+        if (!edge) return;
+        if (deterministic) {
+            st.outbox.push_back(i1);
+        } else {
+            publish(s, i1);
+        }
+    }
+
+    /** Apply edge cell i1 of the stripe on the given side to stripe s */
+    inline void receive(size_t s, size_t side, size_t i1) {
+        Stripe& st = *stripes[s];
+        Stripe& from = *stripes[side == 0 ? above(s) : below(s)];
+        // The sender published its last row to us from above, first below
+        const size_t slot = (1 - side) * stride + i1 % stride;
+
+        // Acquires the edge stored before the matching post
+        from.posted[slot].exchange(false, std::memory_order_acq_rel);
+        for (size_t w = 0; w < W; w++) {
+            st.cell[w] = from.edge[slot * W + w].load(std::memory_order_relaxed);
+        }
+
+        model.neighbors(i1, [&](size_t d, size_t i2) {
+            if (owner[i2 / stride] == s) restrict(st, st.cell.data(), d, i2);
+        });
+    }
+
+    /** Read the mailboxes of stripe s and drain its stack */
+    inline bool drain(size_t s) {
+        Stripe& st = *stripes[s];
+        bool worked = false;
+
+        for (size_t side = 0; side < 2; side++) {
+            const size_t limit =
+                deterministic
+                    ? st.limit[side]
+                    : st.inbox[side].tail.load(std::memory_order_acquire);
+
+            Index i1;
+            while (st.inbox[side].pop(i1, limit)) {
+                receive(s, side, i1);
+                pending.fetch_sub(1);
+                worked = true;
+            }
+        }
+
+        if (!st.stack_len) return worked;
+
+        while (st.stack_len && !contradiction.load(std::memory_order_relaxed)) {
+            const size_t i1 = st.stack[--st.stack_len];
+            st.queued[i1 - st.wave.begin] = false;
+            propagate_cell(s, i1);
+        }
+
+        if (!st.stack_len) {
+            st.active = false;
+            pending.fetch_sub(1);
+        }
+        return true;
+    }
+
+    /** Collapse cell index of stripe st */
+    inline void observe(Stripe& st, size_t index, xoshiro256ss& rng) {
+        std::uniform_real_distribution<double> next_double(0.0, 1.0);
+        const size_t collapsed = st.wave.pick(index, next_double(rng));
+
+        std::fill(st.removed.begin(), st.removed.end(), 0);
+        if (st.wave.collapse(index, collapsed, st.removed.data()))
+            push(st, index);
+    }
+
+    inline void observe(size_t s) {
+        Stripe& st = *stripes[s];
+        if (st.finished) return;
+
+        const int64_t index = st.wave.observe_next(st.rng);
+        if (index < 0) {
+            st.finished = true;
+            return;
+        }
+        observe(st, index, st.rng);
+    }
+
+    /**
+     * One round: observe in the stripes of the given parity (none if -1),
+     * then propagate until every stripe is quiescent.
+     */
+    bool round(ThreadPool& pool, int parity) {
+        const size_t K = stripes.size();
+
+        if (deterministic) {
+            if (parity >= 0) {
+                pool.for_each(K, [&](size_t s, size_t) {
+                    if (s % 2 == size_t(parity) || K == 1) observe(s);
+                });
+            }
+
+            while (!contradiction && !cancelled()) {
+                for (size_t s = 0; s < K; s++) {
+                    for (const Index i1 : stripes[s]->outbox) publish(s, i1);
+                    stripes[s]->outbox.clear();
+                }
+                if (!pending) break;
+
+                for (auto& st : stripes) {
+                    for (size_t side = 0; side < 2; side++) {
+                        st->limit[side] = st->inbox[side].tail.load();
+                    }
+                }
+                pool.for_each(K, [&](size_t s, size_t) { drain(s); });
+            }
+            return !contradiction;
+        }
+
+        // Every task holds pending until it made its observations
+        const size_t T = std::min(pool.size(), K);
+        pending.fetch_add(T);
+
+        pool.for_each(T, [&](size_t task, size_t) {
+            if (parity >= 0) {
+                for (size_t s = task; s < K; s += T) {
+                    if (s % 2 == size_t(parity) || K == 1) observe(s);
+                }
+            }
+            pending.fetch_sub(1);
+
+            while (!contradiction.load(std::memory_order_relaxed) &&
+                   !cancelled()) {
+                bool worked = false;
+                for (size_t s = task; s < K; s += T) worked |= drain(s);
+                if (!worked) {
+                    if (!pending.load()) break;
+                    std::this_thread::yield();
+                }
+            }
+        });
+
+        return !contradiction;
+    }
+
+    struct Snap : Snapshot {
+        vector<typename Wave<Index, Pattern>::State> waves;
+    };
+
+    inline void reset() {
+        for (auto& st : stripes) {
+            std::fill(st->queued.begin(), st->queued.end(), false);
+            st->stack_len = 0;
+            st->active = false;
+            st->finished = false;
+            st->outbox.clear();
+            for (size_t k = 0; k < 2 * stride; k++) st->posted[k] = false;
+            for (auto& box : st->inbox) box.head = box.tail = 0;
+        }
+        pending = 0;
+        contradiction = false;
+    }
+
+   public:
+    /** stripes is clamped so that every stripe has at least N rows */
+    StripedSolver(const Model& model, size_t K, bool deterministic) noexcept
+        : model(model),
+          stride(model.band()),
+          W(Bits::words(model.P)),
+          deterministic(deterministic),
+          owner((model.L() + stride - 1) / stride) {
+        const size_t MY = owner.size();
+        K = std::max<size_t>(1, std::min(K, MY / std::max<size_t>(2, model.N)));
+        // Periodic stripes wrap around, parity only alternates if K is even
+        if (model.periodic && K > 1) K &= ~size_t(1);
+
+        for (size_t s = 0; s < K; s++) {
+            const size_t y0 = MY * s / K, y1 = MY * (s + 1) / K;
+            stripes.push_back(std::make_unique<Stripe>(model, stride, y0, y1));
+            for (size_t y = y0; y < y1; y++) owner[y] = s;
+        }
+    }
+
+    void init(xoshiro256ss& rng) noexcept override {
+        for (auto& st : stripes) {
+            st->rng = xoshiro256ss(rng());
+            st->wave.init(st->rng);
+        }
+        reset();
+    }
+
+    unique_ptr<Snapshot> snapshot() const override {
+        auto snap = std::make_unique<Snap>();
+        snap->waves.resize(stripes.size());
+        for (size_t s = 0; s < stripes.size(); s++) {
+            stripes[s]->wave.save(snap->waves[s]);
+        }
+        return snap;
+    }
+
+    void restore(const Snapshot& snapshot,
+                 xoshiro256ss& rng) noexcept override {
+        const auto& snap = static_cast<const Snap&>(snapshot);
+        for (size_t s = 0; s < stripes.size(); s++) {
+            stripes[s]->rng = xoshiro256ss(rng());
+            stripes[s]->wave.load(snap.waves[s], stripes[s]->rng);
+        }
+        reset();
+    }
+
+    void ban(size_t index, size_t p) noexcept override {
+        Stripe& st = *stripes[owner[index / stride]];
+        st.wave.ban(index, p);
+        if (!st.wave.count(index)) {
+            contradiction.store(true, std::memory_order_relaxed);
+            stats.contradicted = index;
+        }
+        push(st, index);
+    }
+
+    NOINLINE bool propagate() noexcept override {
+        while (pending && !contradiction) {
+            if (cancelled()) return false;
+
+            for (size_t s = 0; s < stripes.size(); s++) {
+                Stripe& st = *stripes[s];
+                for (size_t side = 0; side < 2; side++) {
+                    st.limit[side] = st.inbox[side].tail.load();
+                }
+                drain(s);
+
+                for (const Index i1 : st.outbox) publish(s, i1);
+                st.outbox.clear();
+            }
+        }
+        return !contradiction;
+    }
+
+    bool solve(ThreadPool& pool) noexcept override {
+        if (!round(pool, -1)) return false;
+
+        for (size_t r = 0;; r++) {
+            if (cancelled()) return false;
+
+            bool finished = true;
+            for (auto& st : stripes) finished &= st->finished;
+            if (finished) return true;
+
+            if (!round(pool, r % 2)) return false;
+        }
+    }
+
+    int64_t observe_next(xoshiro256ss&) noexcept override {
+        if (cancelled()) return -2;
+        for (auto& st : stripes) {
+            const int64_t index = st->wave.observe_next(st->rng);
+            if (index >= 0) return index;
+        }
+        return -1;
+    }
+
+    void observe(size_t index, xoshiro256ss& rng) noexcept override {
+        observe(*stripes[owner[index / stride]], index, rng);
+    }
+
+    bool backtrack() noexcept override { return false; }
+
+    bool get(size_t index, size_t pattern) const noexcept override {
+        return stripes[owner[index / stride]]->wave.get(index, pattern);
+    }
+
+    const uint64_t* words(size_t index) const noexcept override {
+        return stripes[owner[index / stride]]->wave.words(index);
+    }
+
+    size_t bytes() const noexcept override {
+        size_t b = owner.size() * sizeof(uint32_t);
+        for (const auto& st : stripes) {
+            b += st->wave.bytes() + st->stack.size() * sizeof(Index) +
+                 st->queued.size() / 8 + 2 * stride * (W * 8 + 1) +
+                 2 * stride * sizeof(Index);
+        }
+        return b;
+    }
+};
+
+#endif  // WFC_STRIPED_SOLVER_HPP_
@@ -0,0 +1,251 @@
+#ifndef WFC_TILED_WFC_HPP_
+#define WFC_TILED_WFC_HPP_
+
+#include <array>
+#include <vector>
+
+#include "utils/array_2d.hpp"
+#include "wfc.hpp"
+
+using std::array;
+using std::vector;
+
+/**
+ * Simple tiled WFC algorithm: the output is a grid of tiles, which can only
+ * be placed next to each other as the neighbor rules allow. Every tile
+ * comes in the orientations its symmetry gives, a pattern being one
+ * (tile, orientation) variant.
+ *
+ * Symmetries and orientations follow mxgmn's SimpleTiledModel: orientation
+ * i < 4 of a tile is its image rotated i times by 90 degrees
+ * counterclockwise (y pointing down), orientation i >= 4 is orientation
+ * i - 4 reflected along x.
+ */
+class TiledWFC : public WFC {
+   public:
+    struct Tile {
+        /**
+         * Symmetry of the tile image: 'X' (none), 'I', '\\', 'T', 'L' or
+         * 'F' (all 8 orientations).
+         */
+        char symmetry;
+        double weight = 1;
+    };
+
+    /**
+     * Tile right in right_orientation can be placed on the right of tile
+     * left in left_orientation. Orientations go up to 8, through the
+     * symmetries of the tile; rules naming a missing tile or orientation
+     * are skipped.
+     */
+    struct Neighbor {
+        uint32_t left;
+        uint8_t left_orientation;
+        uint32_t right;
+        uint8_t right_orientation;
+    };
+
+    /** A pattern of the tiled model */
+    struct Variant {
+        uint32_t tile;
+        uint8_t orientation;
+    };
+
+    /**
+     * Options needed to use the tiled wfc.
+     */
+    struct Options {
+        bool periodic_output;  // True if the output is toric.
+
+        size_t o_W;  // The width of the output in tiles.
+        size_t o_H;  // The height of the output in tiles.
+
+        // heuristic used to pick next position to observe
+        Heuristic heuristic;
+
+        // propagation engine, Auto picks by propagator density
+        Engine engine;
+
+        // backtracks allowed per run before giving up (0 = restart only)
+        uint32_t backtracks;
+
+        // order of the cells in memory, Tiled for very wide outputs
+        Layout layout = Layout::RowMajor;
+    };
+
+   protected:
+    const Options options;
+    const vector<Tile> tiles;
+    const vector<Neighbor> rules;
+
+    /** First variant of each tile, its orientations following */
+    vector<uint32_t> first;
+    vector<Variant> variants;
+
+    /**
+     * Variant reached from each variant by the 8 symmetries: a^i for
+     * i < 4, then b a^(i - 4), a being a rotation and b a reflection.
+     */
+    vector<array<uint32_t, 8>> action;
+
+    /** Number of orientations of a tile symmetry */
+    static inline uint8_t cardinality(char symmetry) noexcept {
+        switch (symmetry) {
+            case 'L':
+            case 'T':
+                return 4;
+            case 'I':
+            case '\\':
+                return 2;
+            case 'F':
+                return 8;
+            default:
+                return 1;
+        }
+    }
+
+    /** Orientation o rotated by 90 degrees (a) */
+    static inline uint8_t rotated(char symmetry, uint8_t o) noexcept {
+        switch (symmetry) {
+            case 'L':
+            case 'T':
+                return (o + 1) % 4;
+            case 'I':
+            case '\\':
+                return 1 - o;
+            case 'F':
+                return o < 4 ? (o + 1) % 4 : 4 + (o - 1) % 4;
+            default:
+                return o;
+        }
+    }
+
+    /** Orientation o reflected (b) */
+    static inline uint8_t reflected(char symmetry, uint8_t o) noexcept {
+        switch (symmetry) {
+            case 'L':
+                return o % 2 == 0 ? o + 1 : o - 1;
+            case 'T':
+                return o % 2 == 0 ? o : 4 - o;
+            case '\\':
+                return 1 - o;
+            case 'F':
+                return o < 4 ? o + 4 : o - 4;
+            default:
+                return o;
+        }
+    }
+
+    /** If both sides of a rule name a tile and one of its orientations */
+    inline bool valid(const Neighbor& r) const noexcept {
+        return r.left < tiles.size() && r.right < tiles.size() &&
+               r.left_orientation < cardinality(tiles[r.left].symmetry) &&
+               r.right_orientation < cardinality(tiles[r.right].symmetry);
+    }
+
+   public:
+    TiledWFC(const Options& options, const vector<Tile>& tiles,
+             const vector<Neighbor>& rules)
+        : WFC(options.o_W, options.o_H, 1, 1, options.periodic_output,
+              options.heuristic, options.engine, options.backtracks,
+              options.layout),
+          options(options),
+          tiles(tiles),
+          rules(rules) {}
+
+   protected:
+    void init() noexcept override {
+        first.clear();
+        variants.clear();
+        action.clear();
+        weights.clear();
+
+        // Expand the symmetries once, actions only walk these tables after
+        for (uint32_t t = 0; t < tiles.size(); t++) {
+            const uint32_t base = variants.size();
+            first.push_back(base);
+
+            const char sym = tiles[t].symmetry;
+
+            for (uint8_t o = 0; o < cardinality(sym); o++) {
+                array<uint32_t, 8> m;
+                uint8_t r = o;
+                for (uint8_t i = 0; i < 4; i++, r = rotated(sym, r)) {
+                    m[i] = base + r;
+                    m[i + 4] = base + reflected(sym, r);
+                }
+
+                action.push_back(m);
+                variants.push_back({t, o});
+                weights.push_back(tiles[t].weight);
+            }
+        }
+
+        P = variants.size();
+
+        // Each rule holds in its 4 symmetric forms, both ways
+        vector<Adjacency> adjacencies;
+        adjacencies.reserve(rules.size() * 16);
+
+        auto allow = [&](uint32_t d, uint32_t p1, uint32_t p2) {
+            adjacencies.push_back({p1, d, p2});
+            adjacencies.push_back({p2, opposite[d], p1});
+        };
+
+        for (const auto& r : rules) {
+            if (!valid(r)) {
+                fprintf(stderr, "skipping rule %u:%u %u:%u, no such tile\n",
+                        r.left, r.left_orientation, r.right,
+                        r.right_orientation);
+                continue;
+            }
+
+            const uint32_t L = action[first[r.left]][r.left_orientation];
+            const uint32_t R = action[first[r.right]][r.right_orientation];
+            const uint32_t D = action[L][1], U = action[R][1];
+
+            allow(0, R, L);
+            allow(0, action[R][6], action[L][6]);
+            allow(0, action[L][4], action[R][4]);
+            allow(0, action[L][2], action[R][2]);
+
+            allow(1, U, D);
+            allow(1, action[D][6], action[U][6]);
+            allow(1, action[U][4], action[D][4]);
+            allow(1, action[D][2], action[U][2]);
+        }
+
+        from_sparse(adjacencies);
+    }
+
+    bool clear(Solver&) noexcept override { return false; }
+
+   public:
+    /** The variant a tile index of the output stands for */
+    inline const Variant& variant(uint32_t index) const noexcept {
+        return variants[index];
+    }
+
+    /**
+     * Transform the wave to a grid of variant indices. This function should
+     * be used only when all cell of the wave are defined.
+     */
+    Array2D<uint32_t> get_output() const noexcept {
+        Array2D<uint32_t> out(MX, MY);
+        get_output(*output, out);
+        return out;
+    }
+
+    /** Write the output of a solver into out, sized MX x MY */
+    void get_output(const Solver& s, Array2D<uint32_t>& out) const noexcept {
+        for (size_t y = 0; y < MY; y++) {
+            for (size_t x = 0; x < MX; x++) {
+                const int64_t p =
+                    Bits::first(s.words(cell(x, y)), Bits::words(P));
+                out.set(x, y, std::max<int64_t>(0, p));
+            }
+        }
+    }
+};
+
+#endif  // WFC_TILED_WFC_HPP_
@@ -0,0 +1,118 @@
+#ifndef WFC_UTILS_BITSET_HPP_
+#define WFC_UTILS_BITSET_HPP_
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Word-parallel operations over bitsets stored as W consecutive uint64_t.
+ * Bit b lives in word b / 64 at position b % 64.
+ */
+namespace Bits {
+
+/** Number of 64-bit words needed to hold n bits */
+static inline constexpr size_t words(size_t n) { return (n + 63) / 64; }
+
+static inline bool test(const uint64_t* bits, size_t b) {
+    return (bits[b >> 6] >> (b & 63)) & 1;
+}
+
+static inline void reset(uint64_t* bits, size_t b) {
+    bits[b >> 6] &= ~(uint64_t(1) << (b & 63));
+}
+
+static inline void set(uint64_t* bits, size_t b) {
+    bits[b >> 6] |= uint64_t(1) << (b & 63);
+}
+
+/** Set the first n bits and clear the padding of the last word */
+static inline void fill(uint64_t* bits, size_t n) {
+    const size_t W = words(n);
+    memset(bits, 0xFF, W * sizeof(uint64_t));
+    if (n & 63) bits[W - 1] = (uint64_t(1) << (n & 63)) - 1;
+}
+
+static inline size_t count(const uint64_t* bits, size_t W) {
+    size_t c = 0;
+    for (size_t w = 0; w < W; w++) c += std::popcount(bits[w]);
+    return c;
+}
+
+/** dst |= src */
+static inline void or_into(uint64_t* __restrict dst,
+                           const uint64_t* __restrict src, size_t W) {
+    size_t w = 0;
+#if defined(__AVX512F__)
+    for (; w + 8 <= W; w += 8) {
+        __m512i a = _mm512_loadu_si512(dst + w);
+        __m512i b = _mm512_loadu_si512(src + w);
+        _mm512_storeu_si512(dst + w, _mm512_or_si512(a, b));
+    }
+#endif
+#if defined(__AVX2__)
+    for (; w + 4 <= W; w += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst + w));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + w));
+        _mm256_storeu_si256((__m256i*)(dst + w), _mm256_or_si256(a, b));
+    }
+#endif
+    for (; w < W; w++) dst[w] |= src[w];
+}
+
+/**
+ * removed = dst & ~mask, dst &= mask.
+ * Return true if any bit was removed.
+ */
+static inline bool restrict_to(uint64_t* __restrict dst,
+                               const uint64_t* __restrict mask,
+                               uint64_t* __restrict removed, size_t W) {
+    uint64_t any = 0;
+    size_t w = 0;
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for (; w + 4 <= W; w += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst + w));
+        __m256i m = _mm256_loadu_si256((const __m256i*)(mask + w));
+        __m256i r = _mm256_andnot_si256(m, a);
+        _mm256_storeu_si256((__m256i*)(removed + w), r);
+        _mm256_storeu_si256((__m256i*)(dst + w), _mm256_and_si256(a, m));
+        acc = _mm256_or_si256(acc, r);
+    }
+    any = !_mm256_testz_si256(acc, acc);
+#endif
+    for (; w < W; w++) {
+        removed[w] = dst[w] & ~mask[w];
+        dst[w] &= mask[w];
+        any |= removed[w];
+    }
+    return any;
+}
+
+/** Index of the first set bit, or -1 if there is none */
+static inline int64_t first(const uint64_t* bits, size_t W) {
+    for (size_t w = 0; w < W; w++) {
+        if (bits[w]) return w * 64 + std::countr_zero(bits[w]);
+    }
+    return -1;
+}
+
+/** Call f(b) for every set bit b, in increasing order */
+template <typename F>
+static inline void for_each(const uint64_t* bits, size_t W, const F& f) {
+    for (size_t w = 0; w < W; w++) {
+        uint64_t word = bits[w];
+        while (word) {
+            f(w * 64 + std::countr_zero(word));
+            word &= word - 1;
+        }
+    }
+}
+
+}  // namespace Bits
+
+#endif  // WFC_UTILS_BITSET_HPP_
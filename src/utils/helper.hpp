@@ -62,6 +62,28 @@ static inline vector<T> squareSymmetries(const T& thing, const Rot& rot,
     return result;
 }
 
+/**
+ * Same 8 symmetries in the same order, without allocating: out[0, S) holds
+ * a pattern of S elements, symmetry i is written to out[i * S, i * S + S).
+ * rot(i) and ref(i) give the index element i of a rotated or reflected
+ * pattern is read from, so layered (voxel) patterns can use it too.
+ */
+template <typename T, typename Rot, typename Ref>
+static inline void squareSymmetries(T* out, size_t S, const Rot& rot,
+                                    const Ref& ref) {
+    auto apply = [&](T* dst, const T* src, const auto& f) {
+        for (size_t i = 0; i < S; i++) dst[i] = src[f(i)];
+    };
+
+    apply(out + 1 * S, out, ref);          // b
+    apply(out + 2 * S, out, rot);          // a
+    apply(out + 3 * S, out + 2 * S, ref);  // ba
+    apply(out + 4 * S, out + 2 * S, rot);  // a2
+    apply(out + 5 * S, out + 4 * S, ref);  // ba2
+    apply(out + 6 * S, out + 4 * S, rot);  // a3
+    apply(out + 7 * S, out + 6 * S, ref);  // ba3
+}
+
 }  // namespace Helper
 
 #endif  // WFC_HELPER_HPP_
\ No newline at end of file
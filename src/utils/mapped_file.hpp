@@ -0,0 +1,72 @@
+#ifndef WFC_UTILS_MAPPED_FILE_HPP_
+#define WFC_UTILS_MAPPED_FILE_HPP_
+
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#include <fstream>
+#include <vector>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Read-only view of a whole file, memory mapped (read into a buffer on
+ * Windows). Empty if the file can't be opened; the mapping is page aligned.
+ */
+class MappedFile {
+    const uint8_t* ptr = nullptr;
+    size_t length = 0;
+
+#ifdef _WIN32
+    std::vector<uint64_t> buffer;
+#endif
+
+   public:
+    explicit MappedFile(const std::string& path) noexcept {
+#ifdef _WIN32
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) return;
+        length = file.tellg();
+        buffer.resize((length + 7) / 8);
+        file.seekg(0);
+        if (!file.read((char*)buffer.data(), length)) {
+            length = 0;
+            return;
+        }
+        ptr = (const uint8_t*)buffer.data();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+
+        struct stat st;
+        if (!fstat(fd, &st) && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                ptr = (const uint8_t*)p;
+                length = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (ptr) munmap((void*)ptr, length);
+#endif
+    }
+
+    inline explicit operator bool() const noexcept { return ptr; }
+    inline const uint8_t* data() const noexcept { return ptr; }
+    inline size_t size() const noexcept { return length; }
+};
+
+#endif  // WFC_UTILS_MAPPED_FILE_HPP_
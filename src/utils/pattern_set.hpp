@@ -0,0 +1,119 @@
+#ifndef WFC_UTILS_PATTERN_SET_HPP_
+#define WFC_UTILS_PATTERN_SET_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using std::size_t;
+using std::vector;
+
+/**
+ * Set of fixed-size byte patterns counting their occurrences, ids given in
+ * first-seen order. The patterns are packed in one buffer and looked up by
+ * open addressing on a 64-bit hash, equality always being checked on the
+ * bytes so colliding hashes can't merge two patterns.
+ */
+class PatternSet {
+    size_t S;
+
+    /** Patterns packed S bytes each, their hashes and their counts */
+    vector<uint8_t> bytes;
+    vector<uint64_t> hashes;
+    vector<uint32_t> counts;
+
+    /**
+     * Open addressing slots, holding id + 1 (0 when empty) and the high half
+     * of the hash, so most mismatches are rejected without reading the
+     * pattern.
+     */
+    struct Slot {
+        uint32_t id;
+        uint32_t tag;
+    };
+    vector<Slot> slots;
+    size_t mask = 0;
+
+    inline void grow() {
+        slots.assign(slots.empty() ? 64 : slots.size() * 2, Slot{0, 0});
+        mask = slots.size() - 1;
+
+        for (uint32_t id = 0; id < hashes.size(); id++) {
+            size_t i = hashes[id] & mask;
+            while (slots[i].id) i = (i + 1) & mask;
+            slots[i] = {id + 1, uint32_t(hashes[id] >> 32)};
+        }
+    }
+
+    /**
+     * Add count occurrences of pattern p, hashing to h. K is S when known
+     * at compile time, so the comparison is inlined, else 0.
+     */
+    template <size_t K = 0>
+    inline uint32_t insert(const uint8_t* p, uint64_t h, uint32_t count) {
+        const size_t S = K ? K : this->S;
+
+        if (2 * (hashes.size() + 1) > slots.size()) grow();
+
+        const uint32_t tag = h >> 32;
+        size_t i = h & mask;
+        for (; slots[i].id; i = (i + 1) & mask) {
+            const uint32_t id = slots[i].id - 1;
+            if (slots[i].tag == tag && !memcmp(bytes.data() + id * S, p, S)) {
+                counts[id] += count;
+                return id;
+            }
+        }
+
+        const uint32_t id = hashes.size();
+        slots[i] = {id + 1, tag};
+        bytes.insert(bytes.end(), p, p + S);
+        hashes.push_back(h);
+        counts.push_back(count);
+        return id;
+    }
+
+   public:
+    /** Set of patterns of S bytes */
+    explicit PatternSet(size_t S = 0) noexcept : S(S) {}
+
+    /** Stable hash of S bytes, read 8 at a time */
+    static inline uint64_t hash(const uint8_t* p, size_t S) noexcept {
+        uint64_t h = S * 0x9e3779b97f4a7c15ull;
+        for (size_t i = 0; i < S; i += 8) {
+            uint64_t w = 0;
+            memcpy(&w, p + i, S - i < 8 ? S - i : 8);
+            h = (h ^ w) * 0xbf58476d1ce4e5b9ull;
+            h ^= h >> 31;
+        }
+        return h ^ (h >> 29);
+    }
+
+    /** Count one more occurrence of p, and return its id */
+    inline uint32_t add(const uint8_t* p) { return insert(p, hash(p, S), 1); }
+
+    /** Same, S being K, known at compile time */
+    template <size_t K>
+    inline uint32_t add(const uint8_t* p) {
+        return insert<K>(p, hash(p, K), 1);
+    }
+
+    /**
+     * Add the patterns of other after the ones of this set, keeping their
+     * order: merging the sets of consecutive parts of an input gives the
+     * ids a single set would have given.
+     */
+    inline void merge(const PatternSet& other) {
+        for (size_t id = 0; id < other.size(); id++) {
+            insert(other[id], other.hashes[id], other.counts[id]);
+        }
+    }
+
+    inline size_t size() const noexcept { return hashes.size(); }
+    inline const uint8_t* operator[](size_t id) const noexcept {
+        return bytes.data() + id * S;
+    }
+    inline uint32_t count(size_t id) const noexcept { return counts[id]; }
+};
+
+#endif  // WFC_UTILS_PATTERN_SET_HPP_
@@ -0,0 +1,88 @@
+#ifndef WFC_UTILS_THREAD_POOL_HPP_
+#define WFC_UTILS_THREAD_POOL_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed set of worker threads running one parallel loop at a time.
+ * for_each must not be called from inside a task, nor from two threads at
+ * once.
+ */
+class ThreadPool {
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+
+    /** Current loop, run by every worker until its tasks run out */
+    std::function<void(size_t)> job;
+    size_t generation = 0;
+    size_t busy = 0;
+    bool stop = false;
+
+    void loop(size_t worker) {
+        size_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock lock(mutex);
+                wake.wait(lock, [&] { return stop || generation != seen; });
+                if (stop) return;
+                seen = generation;
+            }
+
+            job(worker);
+
+            std::lock_guard lock(mutex);
+            if (--busy == 0) idle.notify_all();
+        }
+    }
+
+   public:
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency()) {
+        if (!threads) threads = 1;
+        for (size_t i = 0; i < threads; i++) {
+            workers.emplace_back([this, i] { loop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    inline size_t size() const { return workers.size(); }
+
+    /**
+     * Call f(task, worker) for every task in [0, count), tasks being handed
+     * out in increasing order. Block until all of them returned. worker is
+     * in [0, size()) and identifies the thread, for per-thread state.
+     */
+    template <typename F>
+    void for_each(size_t count, const F& f) {
+        std::atomic<size_t> next = 0;
+
+        {
+            std::lock_guard lock(mutex);
+            job = [&](size_t worker) {
+                for (size_t task; (task = next++) < count;) f(task, worker);
+            };
+            busy = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        std::unique_lock lock(mutex);
+        idle.wait(lock, [&] { return busy == 0; });
+    }
+};
+
+#endif  // WFC_UTILS_THREAD_POOL_HPP_
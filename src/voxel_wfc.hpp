@@ -0,0 +1,245 @@
+#ifndef WFC_VOXEL_WFC_HPP_
+#define WFC_VOXEL_WFC_HPP_
+
+#include <vector>
+
+#include "utils/array_3d.hpp"
+#include "utils/helper.hpp"
+#include "utils/pattern_set.hpp"
+#include "wfc.hpp"
+
+using std::vector;
+
+/**
+ * Overlapping WFC algorithm over voxels: N x N x N patterns are extracted
+ * from a voxel input and overlap along the 6 directions. Symmetries rotate
+ * and reflect the patterns around the z axis only, z being up.
+ */
+class VoxelWFC : public WFC {
+   public:
+    /**
+     * Options needed to use the voxel wfc.
+     */
+    struct Options {
+        bool periodic_input;   // True if the input is toric.
+        bool periodic_output;  // True if the output is toric.
+
+        size_t o_X;  // The size of the output in voxels.
+        size_t o_Y;
+        size_t o_Z;
+
+        // The number of symmetries (the order is defined in wfc).
+        uint32_t symmetry;
+
+        // The size in voxels of the patterns.
+        size_t pattern_size;
+
+        // heuristic used to pick next position to observe
+        Heuristic heuristic;
+
+        // True if the bottom layer of the output is the input's (z = 0)
+        bool ground;
+
+        // propagation engine, Auto picks by propagator density
+        Engine engine;
+
+        // backtracks allowed per run before giving up (0 = restart only)
+        uint32_t backtracks;
+
+        // order of the cells in memory, Tiled stores them in cubes
+        Layout layout = Layout::RowMajor;
+
+        // bits kept of each color channel of the input, fewer merge close
+        // colors (lowered further if the input has more than MAX_COLORS)
+        uint32_t channel_bits = 8;
+    };
+
+   protected:
+    const Options options;
+    // Input ref
+    const Array3D<uint32_t> &input;
+
+    // Patterns, x first, then y, then z
+    vector<vector<Color>> patterns;
+    // Colors
+    vector<uint32_t> colors;
+
+    /** Patterns seen at the bottom of the input, and elsewhere */
+    vector<bool> bottom, above;
+
+   public:
+    VoxelWFC(const Options &options, const Array3D<uint32_t> &input)
+        : WFC(options.o_X, options.o_Y, options.o_Z, options.pattern_size,
+              options.periodic_output, options.heuristic, options.engine,
+              options.backtracks, options.layout),
+          options(options),
+          input(input) {}
+
+   protected:
+    void init() noexcept override {
+        const auto sample =
+            color_ords(input.data, options.channel_bits, colors);
+
+        if (colors.size() <= 256) {
+            extract(vector<uint8_t>(sample.begin(), sample.end()));
+        } else {
+            extract(vector<Color>(sample.begin(), sample.end()));
+        }
+
+        const size_t N2 = N * N, S = N2 * N;
+
+        // Same overlap strips as the 2D model, N x N x (N - 1) voxels
+        PatternSet strips((S - N2) * sizeof(Color));
+        vector<Color> strip(S - N2);
+        vector<uint32_t> keys(P * 6);
+
+        for (size_t p = 0; p < P; p++) {
+            for (uint8_t d = 0; d < 6; d++) {
+                const int dx = DX[d], dy = DY[d], dz = DZ[d];
+                size_t x0 = dx < 0 ? 0 : dx, x1 = dx < 0 ? dx + N : N;
+                size_t y0 = dy < 0 ? 0 : dy, y1 = dy < 0 ? dy + N : N;
+                size_t z0 = dz < 0 ? 0 : dz, z1 = dz < 0 ? dz + N : N;
+
+                size_t k = 0;
+                for (size_t z = z0; z < z1; z++)
+                    for (size_t y = y0; y < y1; y++)
+                        for (size_t x = x0; x < x1; x++)
+                            strip[k++] = patterns[p][x + N * y + N2 * z];
+
+                keys[p * 6 + d] =
+                    strips.add(reinterpret_cast<const uint8_t *>(strip.data()));
+            }
+        }
+
+        from_keys(keys, strips.size(), 6);
+    }
+
+    /**
+     * Set the patterns, their weights and where they were seen from the
+     * sample, the input as color ordinals of type C
+     */
+    template <typename C>
+    void extract(const vector<C> &sample) {
+        patterns.clear();
+        weights.clear();
+        bottom.clear();
+        above.clear();
+
+        const size_t IX = input.MX, IY = input.MY, IZ = input.MZ;
+        const bool pi = options.periodic_input;
+        const size_t xmax = pi ? IX : IX - N + 1;
+        const size_t ymax = pi ? IY : IY - N + 1;
+        const size_t zmax = pi ? IZ : IZ - N + 1;
+
+        const size_t N2 = N * N, S = N2 * N;
+
+        PatternSet set(S * sizeof(C));
+        vector<C> sym(8 * S);
+
+        // Offsets of the pattern voxels, and the voxels its rotation and
+        // reflection read (each layer turns like a 2D pattern)
+        vector<uint32_t> dxs(S), dys(S), dzs(S), rot(S), ref(S);
+        for (uint32_t i = 0; i < S; i++) {
+            dxs[i] = i % N;
+            dys[i] = i / N % N;
+            dzs[i] = i / N2;
+            rot[i] = N - 1 - dys[i] + dxs[i] * N + dzs[i] * N2;
+            ref[i] = N - 1 - dxs[i] + dys[i] * N + dzs[i] * N2;
+        }
+
+        for (size_t z = 0; z < zmax; z++) {
+            for (size_t y = 0; y < ymax; y++) {
+                for (size_t x = 0; x < xmax; x++) {
+                    for (size_t i = 0; i < S; i++) {
+                        size_t sx = x + dxs[i], sy = y + dys[i], sz = z + dzs[i];
+                        if (sx >= IX) sx -= IX;
+                        if (sy >= IY) sy -= IY;
+                        if (sz >= IZ) sz -= IZ;
+                        sym[i] = sample[sx + (sy + sz * IY) * IX];
+                    }
+
+                    Helper::squareSymmetries(
+                        sym.data(), S, [&](size_t i) { return rot[i]; },
+                        [&](size_t i) { return ref[i]; });
+
+                    for (uint8_t i = 0; i < 8; i++) {
+                        if (!((options.symmetry >> i) & 1)) continue;
+
+                        const uint32_t id = set.add(
+                            reinterpret_cast<const uint8_t *>(&sym[i * S]));
+                        if (id == bottom.size()) {
+                            bottom.push_back(false);
+                            above.push_back(false);
+                        }
+                        (z ? above : bottom)[id] = true;
+                    }
+                }
+            }
+        }
+
+        P = set.size();
+        patterns.resize(P);
+        weights.resize(P);
+
+        for (size_t p = 0; p < P; p++) {
+            const C *pattern = reinterpret_cast<const C *>(set[p]);
+            patterns[p].assign(pattern, pattern + S);
+            weights[p] = set.count(p);
+        }
+    }
+
+    /**
+     * Ground: the bottom layer only keeps the patterns seen at the bottom of
+     * the input, and the others lose the patterns only seen there.
+     */
+    bool clear(Solver &s) noexcept override {
+        if (!options.ground) return false;
+
+        for (size_t i = 0; i < L(); i++) {
+            const bool floor = coords(i)[2] == 0;
+            for (size_t p = 0; p < P; p++) {
+                if (floor ? !bottom[p] : !above[p]) s.ban(i, p);
+            }
+        }
+        return true;
+    }
+
+   public:
+    using Voxels = Array3D<uint32_t>;
+
+    /**
+     * Transform the wave to the output voxels (in the input colors). This
+     * function should be used only when all cell of the wave are defined.
+     */
+    Voxels get_output() const noexcept {
+        Voxels out(MX, MY, MZ);
+        get_output(*output, out);
+        return out;
+    }
+
+    /** Write the output of a solver into out, sized MX x MY x MZ */
+    void get_output(const Solver &s, Voxels &out) const noexcept {
+        const size_t N2 = N * N;
+
+        for (size_t z = 0; z < MZ; z++) {
+            size_t dz = z < MZ - N + 1 ? 0 : N - 1;
+
+            for (size_t y = 0; y < MY; y++) {
+                size_t dy = y < MY - N + 1 ? 0 : N - 1;
+
+                for (size_t x = 0; x < MX; x++) {
+                    size_t dx = x < MX - N + 1 ? 0 : N - 1;
+                    size_t index = cell(x - dx, y - dy, z - dz);
+
+                    const size_t ob = std::max<int64_t>(
+                        0, Bits::first(s.words(index), Bits::words(P)));
+
+                    out.set(x, y, z,
+                            colors[patterns[ob][dx + dy * N + dz * N2]]);
+                }
+            }
+        }
+    }
+};
+
+#endif  // WFC_VOXEL_WFC_HPP_
@@ -1,96 +1,293 @@
 #ifndef WFC_WAVE_HPP_
 #define WFC_WAVE_HPP_
 
+#include <bit>
 #include <limits>
 #include <random>
 #include <vector>
 
 using std::vector;
 
-#include "utils/array_2d.hpp"
-#include "utils/array_3d.hpp"
+#include "model.hpp"
+#include "utils/bitset.hpp"
 
 /**
  * Contains the pattern possibilities in every cell.
  * Also contains information about cell entropy (if shannon is true).
+ *
+ * Index is the cell index type and Pattern the pattern id type (it also
+ * holds the per-cell pattern count, so it must fit P).
+ *
+ * A wave can cover only the cells [begin, begin + L) of the grid, so that
+ * several of them partition it. Methods take grid indices either way.
  */
+template <typename Index, typename Pattern>
 class Wave {
    private:
-    vector<double>& weights;
-    vector<double>& wLogW;
+    const Model& model;
+    const vector<double>& weights;
+    const vector<double>& wLogW;
 
-    struct ShannonEntropy {
-        double wSum;      // The sum of p'(pattern).
-        double wSumLogW;  // The sum of p'(pattern) * log(p'(pattern)).
-        double entropy;   // The entropy of the cell.
-    };
+    /** Bitmap of pattern compatbility, W words per cell */
+    vector<uint64_t> data;
 
-    struct CountOnly {
-        uint64_t nb_patterns;  // The number of patterns present
-    };
+    inline constexpr static Index NONE = std::numeric_limits<Index>::max();
 
-    /** Bitmap and counter of pattern compatbility */
-    Array2D<bool> data;
-    Array3D<uint8_t> compatible;
+    /**
+     * Undecided cells, kept ordered incrementally instead of scanning the
+     * whole grid on every observation:
+     * - Entropy: indexed binary min-heap keyed on entropy + noise, see keys.
+     * - MRV: one bucket per remaining pattern count.
+     * position is the slot of a cell in the heap (or in its bucket).
+     */
+    vector<Index> heap;
+    vector<Index> position;
+    vector<vector<Index>> buckets;
+    vector<Pattern> bucket;
+    size_t minBucket = 0;
 
-   public:
-    static inline const uint8_t opposite[] = {2, 3, 0, 1, 5, 4};
+    /** Per-cell tie-breaking noise in [0, 1e-6), drawn once per run */
+    vector<double> noise;
+
+    /**
+     * Heap key of every cell, its entropy plus its noise. Bans only update
+     * the sums of the memo, the entropy (a log and a division) is computed
+     * once per changed cell when the heap is brought up to date.
+     */
+    vector<double> keys;
 
-    struct Propagator {
-        struct Entry {
-            uint32_t offset;
-            uint32_t length;
-        };
+    /** Cells whose count changed since the last observe_next */
+    vector<Index> dirty;
+    vector<bool> isDirty;
 
-        Array2D<Entry> table;
-        vector<uint16_t> flat;
+    // Below, index is relative to begin
 
-        Propagator() : table(0, 0){};
-    };
+    inline void touch(size_t index) {
+        if (isDirty[index]) return;
+        isDirty[index] = true;
+        dirty.push_back(index);
+    }
+
+    /** Return true if cell index is an anchor that gets observed */
+    inline bool eligible(size_t index) const {
+        if (model.periodic) return true;
+        const size_t MX = model.MX, MY = model.MY, MZ = model.MZ;
+        const size_t N = model.N, NZ = model.NZ(), M = model.margin;
+        const auto [x, y, z] = model.coords(index + begin);
+        return x >= M && y >= M && x + N + M <= MX && y + N + M <= MY &&
+               z + NZ <= MZ;
+    }
+
+    inline double key(size_t index) const { return keys[index]; }
+
+    inline void update_key(size_t index) {
+        const double sum = wSums[index];
+        keys[index] = log(sum) - wSumLogWs[index] / sum + noise[index];
+    }
+
+    inline void place(size_t slot, Index index) {
+        heap[slot] = index;
+        position[index] = slot;
+    }
+
+    inline void sift_up(size_t slot) {
+        const Index index = heap[slot];
+        const double k = key(index);
+        while (slot) {
+            size_t parent = (slot - 1) / 2;
+            if (key(heap[parent]) <= k) break;
+            place(slot, heap[parent]);
+            slot = parent;
+        }
+        place(slot, index);
+    }
+
+    inline void sift_down(size_t slot) {
+        const Index index = heap[slot];
+        const double k = key(index);
+        const size_t size = heap.size();
+        while (true) {
+            size_t child = 2 * slot + 1;
+            if (child >= size) break;
+            if (child + 1 < size && key(heap[child + 1]) < key(heap[child]))
+                child++;
+            if (key(heap[child]) >= k) break;
+            place(slot, heap[child]);
+            slot = child;
+        }
+        place(slot, index);
+    }
+
+    inline void heap_update(size_t index) {
+        const bool open = counts[index] > 1;
+        const Index slot = position[index];
+
+        if (slot == NONE) {
+            if (!open) return;
+            heap.push_back(index);
+            place(heap.size() - 1, index);
+            sift_up(heap.size() - 1);
+        } else if (!open) {
+            const Index last = heap.back();
+            heap.pop_back();
+            position[index] = NONE;
+            if (last != index) {
+                place(slot, last);
+                sift_up(slot);
+                sift_down(position[last]);
+            }
+        } else {
+            sift_up(slot);
+            sift_down(position[index]);
+        }
+    }
 
-    /** Type of heuristic used to choose next unobserved node **/
-    enum class Heuristic { Entropy, MRV, Scanline };
+    inline void bucket_update(size_t index) {
+        const Pattern c = counts[index] > 1 ? counts[index] : 0;
+        const Pattern b = bucket[index];
+        if (b == c) return;
+
+        if (b) {
+            auto& from = buckets[b];
+            const Index last = from.back();
+            from[position[index]] = last;
+            position[last] = position[index];
+            from.pop_back();
+        }
+        if (c) {
+            position[index] = buckets[c].size();
+            buckets[c].push_back(index);
+            if (c < minBucket) minBucket = c;
+        }
+        bucket[index] = c;
+    }
+
+    /** Bring the heap or the buckets up to date with the dirty cells */
+    inline void flush() {
+        for (const Index index : dirty) {
+            isDirty[index] = false;
+            if (!eligible(index)) continue;
+            if (heuristic == Heuristic::Entropy) {
+                if (counts[index] > 1) update_key(index);
+                heap_update(index);
+            } else {
+                bucket_update(index);
+            }
+        }
+        dirty.clear();
+    }
+
+   public:
     // Counter
-    vector<uint16_t> counts;
-    /** Memoisation for computating entropy */
-    vector<ShannonEntropy> memoisations;
+    vector<Pattern> counts;
+    /**
+     * Memoisation for computating entropy, per cell: the sum of the weights
+     * of its patterns, and of weight * log(weight)
+     */
+    vector<double> wSums, wSumLogWs;
 
-    /** L = total elements in the grid */
-    const size_t L, P, D;
+    /** begin = first cell, L = number of cells, W = words per cell */
+    const size_t begin, L, P, W;
     const Heuristic heuristic;
 
     /** Initialize the wave with every cell being able to have every pattern */
-    Wave(size_t L, size_t P, size_t D, vector<double>& weights,
-         vector<double>& wLogW, Heuristic heuristic) noexcept
-        : L(L),
-          P(P),
-          D(D),
-          heuristic(heuristic),
-          data(P, L),
-          counts(L),
-          memoisations(0),
-          compatible(D, P, L),
-          weights(weights),
-          wLogW(wLogW) {}
-
-    inline void init(const Propagator& propagator, double wSum, double wSumLogW,
-                     double e0) {
-        data.fill(true);
-
-        for (size_t i = 0; i < L; i++) {
-            for (size_t p = 0; p < P; p++) {
-                for (size_t d = 0; d < D; d++) {
-                    compatible.set(d, p, i,
-                                   propagator.table.get(opposite[d], p).length);
-                }
-            }
+    Wave(const Model& model) noexcept : Wave(model, 0, model.L()) {}
+
+    /** Same, over the cells [begin, end) only */
+    Wave(const Model& model, size_t begin, size_t end) noexcept
+        : model(model),
+          weights(model.weights),
+          wLogW(model.wLogW),
+          data((end - begin) * Bits::words(model.P)),
+          isDirty(end - begin),
+          counts(end - begin),
+          begin(begin),
+          L(end - begin),
+          P(model.P),
+          W(Bits::words(model.P)),
+          heuristic(model.heuristic) {
+        if (heuristic != Heuristic::Scanline) {
+            position.resize(L);
+            dirty.reserve(L);
         }
+        if (heuristic == Heuristic::Entropy) {
+            wSums.resize(L);
+            wSumLogWs.resize(L);
+            heap.reserve(L);
+            noise.resize(L);
+            keys.resize(L);
+        } else if (heuristic == Heuristic::MRV) {
+            buckets.resize(P + 1);
+            bucket.resize(L);
+        }
+    }
+
+    template <typename RNG>
+    inline void init(RNG& gen) {
+        for (size_t i = 0; i < L; i++) Bits::fill(&data[i * W], P);
 
         std::fill(counts.begin(), counts.end(), P);
 
         if (heuristic == Heuristic::Entropy) {
-            memoisations = vector<ShannonEntropy>(
-                L, {.wSum = wSum, .wSumLogW = wSumLogW, .entropy = e0});
+            std::fill(wSums.begin(), wSums.end(), model.wSum);
+            std::fill(wSumLogWs.begin(), wSumLogWs.end(), model.wSumLogW);
+        }
+
+        select(gen);
+    }
+
+    /** Bitmap, counts and entropy memo of a wave, see save and load */
+    struct State {
+        vector<uint64_t> data;
+        vector<Pattern> counts;
+        vector<double> wSums, wSumLogWs;
+    };
+
+    inline void save(State& state) const {
+        state.data = data;
+        state.counts = counts;
+        state.wSums = wSums;
+        state.wSumLogWs = wSumLogWs;
+    }
+
+    /** Reset the wave to a saved state, drawing new tie-breaking noise */
+    template <typename RNG>
+    inline void load(const State& state, RNG& gen) {
+        std::copy(state.data.begin(), state.data.end(), data.begin());
+        std::copy(state.counts.begin(), state.counts.end(), counts.begin());
+        std::copy(state.wSums.begin(), state.wSums.end(), wSums.begin());
+        std::copy(state.wSumLogWs.begin(), state.wSumLogWs.end(),
+                  wSumLogWs.begin());
+
+        select(gen);
+    }
+
+    /** Rebuild the heap or the buckets from the current counts */
+    template <typename RNG>
+    inline void select(RNG& gen) {
+        dirty.clear();
+        std::fill(isDirty.begin(), isDirty.end(), false);
+
+        if (heuristic == Heuristic::Entropy) {
+            std::uniform_real_distribution<double> gen_noise(0.0, 1e-6);
+            for (size_t i = 0; i < L; i++) noise[i] = gen_noise(gen);
+
+            heap.clear();
+            std::fill(position.begin(), position.end(), NONE);
+            for (size_t i = 0; i < L; i++) {
+                if (counts[i] < 2 || !eligible(i)) continue;
+                update_key(i);
+                position[i] = heap.size();
+                heap.push_back(i);
+            }
+            for (size_t slot = heap.size() / 2; slot-- > 0;) sift_down(slot);
+        } else if (heuristic == Heuristic::MRV) {
+            for (auto& b : buckets) b.clear();
+            std::fill(bucket.begin(), bucket.end(), 0);
+            minBucket = P;
+            for (size_t i = 0; i < L; i++) {
+                if (eligible(i)) bucket_update(i);
+            }
         } else if (heuristic == Heuristic::Scanline) {
             scanCursor = 0;
         }
@@ -98,96 +295,168 @@ class Wave {
 
     /** Return true if pattern can be placed in cell index */
     inline bool get(size_t index, size_t pattern) const noexcept {
-        return data.get(pattern, index);
+        return Bits::test(words(index), pattern);
+    }
+
+    /** Number of patterns left in cell index */
+    inline Pattern count(size_t index) const noexcept {
+        return counts[index - begin];
+    }
+
+    /** The W bitmap words of cell index */
+    inline uint64_t* words(size_t index) noexcept {
+        return &data[(index - begin) * W];
+    }
+    inline const uint64_t* words(size_t index) const noexcept {
+        return &data[(index - begin) * W];
     }
 
     /** Ban pattern in cell index */
     inline void ban(size_t index, size_t pattern) noexcept {
-        data.set(pattern, index, false);
-        for (size_t d = 0; d < D; d++) {
-            compatible.set(d, pattern, index, 0);
-        }
+        Bits::reset(words(index), pattern);
+        forget(index, pattern);
+    }
 
+    /**
+     * Update the count and entropy of cell index after pattern was cleared
+     * from its bitmap.
+     */
+    inline void forget(size_t index, size_t pattern) noexcept {
+        index -= begin;
         counts[index]--;
 
         if (heuristic == Heuristic::Entropy) {
-            double sum = memoisations[index].wSum;
-            memoisations[index].entropy +=
-                memoisations[index].wSumLogW / sum - log(sum);
+            wSums[index] -= weights[pattern];
+            wSumLogWs[index] -= wLogW[pattern];
+        }
 
-            memoisations[index].wSum -= weights[pattern];
-            memoisations[index].wSumLogW -= wLogW[pattern];
+        if (heuristic != Heuristic::Scanline) touch(index);
+    }
 
-            sum = memoisations[index].wSum;
-            memoisations[index].entropy -=
-                memoisations[index].wSumLogW / sum - log(sum);
+    /**
+     * Draw one of the patterns left in cell index with probability
+     * proportional to its weight, given r uniform in [0, 1). Only walks the
+     * set bits, and takes the weight sum from the entropy memo if kept.
+     */
+    inline size_t pick(size_t index, double r) const noexcept {
+        const uint64_t* cell = words(index);
+
+        double sum = 0;
+        if (heuristic == Heuristic::Entropy) {
+            sum = wSums[index - begin];
+        } else {
+            Bits::for_each(cell, W, [&](size_t p) { sum += weights[p]; });
+        }
+        const double threshold = r * sum;
+
+        double partial = 0;
+        size_t last = 0;
+        for (size_t w = 0; w < W; w++) {
+            for (uint64_t word = cell[w]; word; word &= word - 1) {
+                last = w * 64 + std::countr_zero(word);
+                partial += weights[last];
+                if (partial >= threshold) return last;
+            }
         }
+
+        // Only reached if rounding left the memo sum above the actual one
+        return last;
     }
 
-    size_t scanCursor = 0;
+    /**
+     * Ban every pattern of cell index but pattern, in one pass over its
+     * words. The banned ones are OR-ed into removed (W words), and their
+     * number returned.
+     */
+    inline size_t collapse(size_t index, size_t pattern,
+                           uint64_t* removed) noexcept {
+        uint64_t* cell = words(index);
+        size_t banned = 0;
+        for (size_t w = 0; w < W; w++) {
+            const uint64_t keep =
+                w == pattern / 64 ? uint64_t(1) << (pattern % 64) : 0;
+            const uint64_t gone = cell[w] & ~keep;
+            removed[w] |= gone;
+            banned += std::popcount(gone);
+            cell[w] &= keep;
+        }
+
+        index -= begin;
+        counts[index] -= banned;
+
+        if (heuristic == Heuristic::Entropy) {
+            wSums[index] = weights[pattern];
+            wSumLogWs[index] = wLogW[pattern];
+        }
+
+        if (heuristic != Heuristic::Scanline) touch(index);
+        return banned;
+    }
+
+    /** Put back pattern in cell index, undoing ban */
+    inline void unban(size_t index, size_t pattern) noexcept {
+        Bits::set(words(index), pattern);
+        index -= begin;
+        counts[index]++;
+
+        if (heuristic == Heuristic::Entropy) {
+            wSums[index] += weights[pattern];
+            wSumLogWs[index] += wLogW[pattern];
+        }
+
+        if (heuristic == Heuristic::Scanline) {
+            if (index < scanCursor) scanCursor = index;
+        } else {
+            touch(index);
+        }
+    }
+
+    Index scanCursor = 0;
     /**
      * Return the index of the cell with lowest entropy different of 0.
      * If there is a contradiction in the wave, return -2.
      * If every cell is decided, return -1.
      */
     template <typename RNG>
-    inline int observe_next(size_t MX, size_t MY, size_t MZ, size_t N,
-                            bool periodic, RNG& gen) noexcept {
+    inline int64_t observe_next(RNG& gen) noexcept {
         if (heuristic == Heuristic::Scanline) {
             for (size_t i = scanCursor; i < L; i++) {
-                size_t x = i % MX;
-                size_t y = (i % (MX * MY)) / MX;
-                size_t z = i / (MX * MY);
-
-                if (!periodic && (x + N > MX || y + N > MY || z + 1 > MZ))
-                    continue;
+                if (!eligible(i)) continue;
 
                 if (counts[i] > 1) {
                     scanCursor = i + 1;
-                    return i;
+                    return begin + i;
                 }
             }
             return -1;
         }
 
-        double min = std::numeric_limits<double>::max();
-        int argmin = -1;
-
-        std::uniform_real_distribution<double> gen_noise(0.0, 1e-6);
-
-        for (size_t z = 0; z < MZ; z++) {
-            for (size_t y = 0; y < MY; y++) {
-                for (size_t x = 0; x < MX; x++) {
-                    if (!periodic && (x + N > MX || y + N > MY || z + 1 > MZ))
-                        continue;
-                    size_t i = x + y * MX + z * MX * MY;
-                    uint32_t remainingValues = counts[i];
-                    double entropy = heuristic == Heuristic::Entropy
-                                         ? memoisations[i].entropy
-                                         : remainingValues;
-                    if (remainingValues > 1 && entropy <= min) {
-                        double noise = gen_noise(gen);
-                        if (entropy + noise < min) {
-                            min = entropy + noise;
-                            argmin = i;
-                        }
-                    }
-                }
-            }
+        flush();
+
+        if (heuristic == Heuristic::Entropy) {
+            return heap.empty() ? -1 : begin + heap[0];
         }
-        return argmin;
-    };
 
-    inline int32_t decre_comp(uint8_t dir, size_t pattern, size_t index) {
-        auto& c = this->compatible.ref(dir, pattern, index);
-        // Hopefully save 1 unnecessary store op
-        return (c <= 0) ? -1 : --c;
-    }
+        while (minBucket <= P && buckets[minBucket].empty()) minBucket++;
+        if (minBucket > P) return -1;
+
+        // Ties between equal counts are broken uniformly
+        const auto& b = buckets[minBucket];
+        std::uniform_int_distribution<size_t> pick(0, b.size() - 1);
+        return begin + b[pick(gen)];
+    };
 
-    inline size_t bytes() {
-        return compatible.data.size() * sizeof(compatible.data[0]) +
-               counts.size() * sizeof(counts[0]);
+    inline size_t bytes() const {
+        size_t b = data.size() * sizeof(data[0]) +
+                   counts.size() * sizeof(counts[0]) +
+                   (wSums.size() + wSumLogWs.size() + keys.size()) *
+                       sizeof(double) +
+                   (heap.capacity() + position.size()) * sizeof(Index) +
+                   noise.size() * sizeof(double) +
+                   bucket.size() * sizeof(Pattern) + isDirty.size() / 8;
+        for (const auto& v : buckets) b += v.capacity() * sizeof(Index);
+        return b;
     }
 };
 
-#endif  // WFC_WAVE_HPP_
\ No newline at end of file
+#endif  // WFC_WAVE_HPP_
@@ -1,94 +1,169 @@
 #ifndef WFC_WFC_HPP_
 #define WFC_WFC_HPP_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <optional>
 #include <random>
-
+#include <string>
+#include <unordered_map>
+
+#include "compiled_model.hpp"
+#include "dense_solver.hpp"
+#include "model.hpp"
+#include "solver.hpp"
+#include "sparse_solver.hpp"
+#include "striped_solver.hpp"
 #include "utils/array_2d.hpp"
+#include "utils/thread_pool.hpp"
 #include "utils/xoshiro256ss.hpp"
-#include "wave.hpp"
 
 using std::optional;
 using std::vector;
 
-#ifdef WIN32
-#define NOINLINE __declspec(noinline)
-#else
-#define NOINLINE __attribute__((noinline))
-#endif
-
 namespace {
-static int sample(vector<double> weights, double r) {
-    double sum = 0;
-    for (size_t i = 0; i < weights.size(); i++) sum += weights[i];
-    double threshold = r * sum;
-
-    double partialSum = 0;
-    for (size_t i = 0; i < weights.size(); i++) {
-        partialSum += weights[i];
-        if (partialSum >= threshold) return i;
+template <typename Index, typename Pattern>
+static unique_ptr<Solver> make_solver(const Model& model, uint32_t length) {
+    if (model.engine == Engine::Dense) {
+        return std::make_unique<DenseSolver<Index, Pattern>>(model);
+    }
+    if (length <= UINT8_MAX) {
+        return std::make_unique<SparseSolver<Index, Pattern, uint8_t>>(model);
+    }
+    if constexpr (sizeof(Pattern) >= sizeof(uint16_t)) {
+        if (length <= UINT16_MAX) {
+            return std::make_unique<SparseSolver<Index, Pattern, uint16_t>>(
+                model);
+        }
     }
-    return 0;
+    if constexpr (sizeof(Pattern) >= sizeof(uint32_t)) {
+        return std::make_unique<SparseSolver<Index, Pattern, uint32_t>>(model);
+    }
+    return nullptr;
+}
+
+template <typename Index>
+static unique_ptr<Solver> make_solver(const Model& model, uint32_t length) {
+    // Pattern is the type the propagator lists were packed in
+    const size_t bytes = Propagator::id_bytes(model.P);
+    if (bytes == 1) return make_solver<Index, uint8_t>(model, length);
+    if (bytes == 2) return make_solver<Index, uint16_t>(model, length);
+    return make_solver<Index, uint32_t>(model, length);
+}
+
+template <typename Index>
+static unique_ptr<ParallelSolver> make_striped(const Model& model,
+                                               size_t stripes,
+                                               bool deterministic) {
+    const size_t bytes = Propagator::id_bytes(model.P);
+    if (bytes == 1) {
+        return std::make_unique<StripedSolver<Index, uint8_t>>(model, stripes,
+                                                               deterministic);
+    }
+    if (bytes == 2) {
+        return std::make_unique<StripedSolver<Index, uint16_t>>(
+            model, stripes, deterministic);
+    }
+    return std::make_unique<StripedSolver<Index, uint32_t>>(model, stripes,
+                                                            deterministic);
 }
 }  // namespace
 
 /**
- * Class containing the generic WFC algorithm.
+ * Pick the narrowest solver instantiation for a model: the cell index type
+ * from L, the pattern id type from P and the counter type from the longest
+ * propagator list (the dense engine has no counters). Must be called after
+ * the propagator is built and the engine resolved.
  */
-class WFC {
-   protected:
-    using Heuristic = Wave::Heuristic;
-    using Propagator = Wave::Propagator;
+inline unique_ptr<Solver> make_solver(const Model& model) {
+    const size_t L = model.L();
+    const uint32_t length = model.propagator.max_length();
 
-   private:
-    vector<double> wLogW;
-    vector<double> distribution;
+    fprintf(stderr, "engine: %s, max compatible = %u\n",
+            model.engine == Engine::Dense ? "dense" : "sparse", length);
 
-    double wSum, wSumLogW, e0;
+    // The largest Index value is reserved as a sentinel
+    if (L <= UINT16_MAX) return make_solver<uint16_t>(model, length);
+    return make_solver<uint32_t>(model, length);
+}
 
-    struct BanItem {
-        uint16_t index;
-        uint16_t pattern;
-    };
+/**
+ * Same for the striped solver, which needs the dense propagator rows.
+ */
+inline unique_ptr<ParallelSolver> make_striped(const Model& model,
+                                               size_t stripes,
+                                               bool deterministic) {
+    if (model.L() <= UINT16_MAX)
+        return make_striped<uint16_t>(model, stripes, deterministic);
+    return make_striped<uint32_t>(model, stripes, deterministic);
+}
 
-    vector<BanItem> stack;
-    size_t stack_len = 0;
+/** Outcome of one seed of WFC::generate_batch */
+struct BatchResult {
+    uint32_t seed;
+    bool success;
+    double ms;              // Wall time of the attempt
+    size_t contradictions;  // Contradictions hit, backtracked or final
+    size_t worker;          // Thread that ran it, in [0, pool.size())
+    const Solver& solver;   // Its final state, valid during the callback
+};
 
-    /** The propagator, used to propagate the information in the wave */
-    Propagator propagator;
-    // Propagator propagator_copy;
+/**
+ * Class containing the generic WFC algorithm.
+ */
+class WFC : protected Model {
+   public:
+    using Heuristic = ::Heuristic;
+    using Engine = ::Engine;
+    using Layout = ::Layout;
+    using Stats = ::Stats;
 
-   protected:
-    inline constexpr static int8_t DX[] = {-1, 0, 1, 0, 0, 0};
-    inline constexpr static int8_t DY[] = {0, 1, 0, -1, 0, 0};
-    inline constexpr static int8_t DZ[] = {0, 0, 0, 0, 1, -1};
+    /**
+     * Ordinal of a color of an input. Inputs of at most 256 colors are
+     * still extracted with 8-bit ordinals.
+     */
+    using Color = uint16_t;
 
-    size_t P = 0;
-    const size_t MX, MY, MZ, N;
+    /** Colors an input can have, UINT16_MAX marking unknown pixels */
+    inline constexpr static size_t MAX_COLORS = UINT16_MAX;
 
-    const bool periodic;
-    const Heuristic heuristic;
+   protected:
+    using Propagator = ::Propagator;
+
+    /** Per-run state, picked by make_solver once the model is known */
+    unique_ptr<Solver> solver;
 
-    /** Distribution of the patterns as given in input */
-    vector<double> weights;
+    /** Solver of the last run, read by the outputs and stats() */
+    const Solver* output = nullptr;
 
-    /** The wave, indicating which patterns can be put in which cell */
-    Wave* wave = nullptr;
+    /**
+     * Pool init may spread its work over, only set while building from a
+     * call given one.
+     */
+    ThreadPool* build_pool = nullptr;
 
     virtual void init() noexcept = 0;
-    virtual bool clear() noexcept = 0;
+    /** Apply the initial constraints, return true if they need propagating */
+    virtual bool clear(Solver& s) noexcept = 0;
 
+    /**
+     * Build the propagator from agree(p1, p2, d), over the first 4 (2D) or 6
+     * (voxels) directions.
+     */
     template <typename CB>
-    inline void from_dense(const CB& agree) {
-        propagator.flat.clear();
-        propagator.table = Array2D<Propagator::Entry>(4, P);
+    inline void from_dense(const CB& agree, uint8_t directions = 4) {
+        vector<uint32_t> flat;
+        propagator.table = Array2D<Propagator::Entry>(directions, P);
 
         uint32_t offset = 0;
         uint32_t dense = 0;
 
         for (uint32_t p1 = 0; p1 < P; p1++) {
 #pragma unroll
-            for (uint8_t d = 0; d < 4; d++) {
+            for (uint8_t d = 0; d < directions; d++) {
                 Propagator::Entry entry{};
                 entry.offset = offset;
 
@@ -96,7 +171,7 @@ class WFC {
                     if (agree(p1, p2, d)) {
                         offset++;
                         entry.length++;
-                        propagator.flat.push_back(p2);
+                        flat.push_back(p2);
                     }
                 }
 
@@ -105,42 +180,281 @@ class WFC {
             }
         }
 
-        propagator.flat.shrink_to_fit();
+        propagator.pack(flat, P);
+        propagator.density = double(dense) / (P * P * directions);
 
         // density = 100% - sparsity
         fprintf(stderr, "Propagator density: %.2f%%\n",
-                100.f * dense / (P * P * 4));
+                100.f * propagator.density);
     }
 
-    /** Initialize wave */
-    void post_init() noexcept {
-        size_t L = MX * MY * MZ;
-        size_t D = propagator.table.MX;
-        stack.reserve(L * P);
-        stack.resize(L * P);
-        stack_len = 0;
+    /**
+     * Build the propagator from overlap keys, in O(P * average degree)
+     * instead of from_dense's P * P checks: p2 is compatible with p1 in
+     * direction d iff keys[p1 * directions + d] equals
+     * keys[p2 * directions + opposite[d]], keys being in [0, K). Patterns are
+     * bucketed by key per direction, a compatible list being a bucket, and
+     * the lists come out in the same order as from_dense's.
+     */
+    inline void from_keys(const vector<uint32_t>& keys, size_t K,
+                          uint8_t directions = 4) {
+        const size_t D = directions;
+
+        // Bucket of direction d and key k: the p2 with key(p2, opposite[d])
+        // = k, in increasing order
+        vector<uint32_t> start(D * K + 1, 0), members(P * D);
+        for (uint32_t p = 0; p < P; p++) {
+            for (size_t d = 0; d < D; d++)
+                start[d * K + keys[p * D + opposite[d]] + 1]++;
+        }
+        for (size_t b = 0; b < D * K; b++) start[b + 1] += start[b];
 
-        wSum = 0;
-        wSumLogW = 0;
-        e0 = 0;
+        vector<uint32_t> fill(start.begin(), start.end() - 1);
+        for (uint32_t p = 0; p < P; p++) {
+            for (size_t d = 0; d < D; d++)
+                members[fill[d * K + keys[p * D + opposite[d]]]++] = p;
+        }
 
-        if (heuristic == Heuristic::Entropy) {
-            wLogW = vector<double>(P, 0);
+        propagator.table = Array2D<Propagator::Entry>(D, P);
+
+        uint32_t offset = 0;
+        for (uint32_t p1 = 0; p1 < P; p1++) {
+            for (size_t d = 0; d < D; d++) {
+                const size_t b = d * K + keys[p1 * D + d];
+                const uint32_t length = start[b + 1] - start[b];
+                propagator.table.set(d, p1, {offset, length});
+                offset += length;
+            }
+        }
+
+        // Sized once, the lists are copied in parallel when possible
+        vector<uint32_t> flat(offset);
+        auto copy = [&](size_t p1) {
+            for (size_t d = 0; d < D; d++) {
+                const size_t b = d * K + keys[p1 * D + d];
+                std::copy(&members[start[b]], &members[start[b + 1]],
+                          &flat[propagator.table.get(d, p1).offset]);
+            }
+        };
+
+        if (build_pool) {
+            const size_t blocks = 4 * build_pool->size();
+            build_pool->for_each(blocks, [&](size_t block, size_t) {
+                for (size_t p = block * P / blocks;
+                     p < (block + 1) * P / blocks; p++)
+                    copy(p);
+            });
+        } else {
+            for (size_t p = 0; p < P; p++) copy(p);
+        }
+
+        propagator.pack(flat, P);
+        propagator.density = double(offset) / (P * P * D);
+
+        fprintf(stderr, "Propagator density: %.2f%%\n",
+                100.f * propagator.density);
+    }
+
+    /** Pattern p2 is allowed next to p1 in direction d */
+    struct Adjacency {
+        uint32_t p1;
+        uint32_t d;
+        uint32_t p2;
+
+        inline bool operator<(const Adjacency& a) const noexcept {
+            return p1 != a.p1 ? p1 < a.p1 : d != a.d ? d < a.d : p2 < a.p2;
+        }
+        inline bool operator==(const Adjacency& a) const noexcept = default;
+    };
+
+    /**
+     * Build the propagator straight from a list of adjacencies, which may
+     * repeat, in O(A log A) instead of from_dense's P * P checks. The lists
+     * come out in the same order as from_dense's.
+     */
+    inline void from_sparse(vector<Adjacency>& adjacencies,
+                            uint8_t directions = 4) {
+        std::sort(adjacencies.begin(), adjacencies.end());
+        adjacencies.erase(
+            std::unique(adjacencies.begin(), adjacencies.end()),
+            adjacencies.end());
+
+        vector<uint32_t> flat(adjacencies.size());
+        propagator.table = Array2D<Propagator::Entry>(directions, P);
+
+        uint32_t k = 0;
+        for (uint32_t p1 = 0; p1 < P; p1++) {
+            for (uint8_t d = 0; d < directions; d++) {
+                Propagator::Entry entry{.offset = k, .length = 0};
+
+                while (k < adjacencies.size() && adjacencies[k].p1 == p1 &&
+                       adjacencies[k].d == d) {
+                    flat[k] = adjacencies[k].p2;
+                    entry.length++;
+                    k++;
+                }
 
-            for (size_t i = 0; i < P; i++) {
-                wLogW[i] = weights[i] * log(weights[i]);
-                wSum += weights[i];
-                wSumLogW += wLogW[i];
+                propagator.table.set(d, p1, entry);
             }
+        }
+
+        propagator.pack(flat, P);
+        propagator.density = double(flat.size()) / (P * P * directions);
+
+        fprintf(stderr, "Propagator density: %.2f%%\n",
+                100.f * propagator.density);
+    }
+
+    /** Initialize the model constants */
+    void post_init() noexcept {
+        init_entropy();
+        init_engine();
+
+        fprintf(stderr, "P = %lu, D = %lu, L = %lu\n", P, D(), L());
+    }
+
+    /** Build the model on first use */
+    bool built = false;
+    inline void build(ThreadPool* pool = nullptr) {
+        if (built) return;
+        built = true;
+
+        build_pool = pool;
+        init();
+        build_pool = nullptr;
+        post_init();
+    }
+
+    /**
+     * Write the built model to a compiled model file (see Compiled), with
+     * the patterns and colors sections of the subclass.
+     */
+    bool save_model(const std::string& path, uint64_t key,
+                    Compiled::Data patterns, size_t pattern_bytes,
+                    Compiled::Data colors) {
+        build();
+
+        // Written whatever the heuristic, a file serves every heuristic
+        vector<double> wlogw(P);
+        double sum = 0, sum_log = 0;
+        for (size_t p = 0; p < P; p++) {
+            wlogw[p] = weights[p] * log(weights[p]);
+            sum += weights[p];
+            sum_log += wlogw[p];
+        }
 
-            e0 = log(wSum) - wSumLogW / wSum;
+        Compiled::Header h{.magic = Compiled::MAGIC,
+                           .version = Compiled::VERSION,
+                           .key = key,
+                           .P = P,
+                           .D = D(),
+                           .pattern_bytes = pattern_bytes,
+                           .flat_width = 0,
+                           .density = propagator.density,
+                           .wSum = sum,
+                           .wSumLogW = sum_log,
+                           .e0 = log(sum) - sum_log / sum,
+                           .sections = {}};
+
+        Compiled::Data flat = std::visit(
+            [&](const auto& v) {
+                h.flat_width = sizeof(v[0]);
+                return Compiled::Data{v.data(), v.size() * sizeof(v[0])};
+            },
+            propagator.flat);
+
+        const auto& table = propagator.table.data;
+        return Compiled::write(
+            path, h,
+            {patterns,
+             colors,
+             {weights.data(), P * sizeof(double)},
+             {wlogw.data(), P * sizeof(double)},
+             {table.data(), table.size() * sizeof(table[0])},
+             flat});
+    }
+
+    /**
+     * Take weights and propagator from a compiled model instead of building
+     * them, each section being copied from the mapping as is. Leaves the
+     * model untouched and returns false if the sections don't fit P and the
+     * directions of the model, or the table points past the lists.
+     */
+    bool load_model(const Compiled::File& file) {
+        using namespace Compiled;
+        const Header& h = file.header();
+
+        if (built || h.D != (MZ > 1 ? 6u : 4u) ||
+            h.flat_width != Propagator::id_bytes(h.P) ||
+            file.bytes(Weights) != h.P * sizeof(double) ||
+            file.bytes(WLogW) != h.P * sizeof(double) ||
+            file.bytes(Table) != h.D * h.P * sizeof(Propagator::Entry) ||
+            file.bytes(Flat) % h.flat_width)
+            return false;
+
+        // Every list of the table has to lie within the flat ids
+        const uint64_t ids = file.bytes(Flat) / h.flat_width;
+        const auto* entries =
+            reinterpret_cast<const Propagator::Entry*>(file.section(Table));
+        for (size_t i = 0; i < h.D * h.P; i++) {
+            if (uint64_t(entries[i].offset) + entries[i].length > ids)
+                return false;
         }
 
-        distribution = vector<double>(P);
+        auto copy = [&]<typename T>(vector<T>& v, Section s) {
+            v.resize(file.bytes(s) / sizeof(T));
+            memcpy(v.data(), file.section(s), file.bytes(s));
+        };
+
+        P = h.P;
+        copy(weights, Weights);
 
-        wave = new Wave(L, P, D, weights, wLogW, heuristic);
+        wSum = wSumLogW = e0 = 0;
+        wLogW.clear();
+        if (heuristic == Heuristic::Entropy) {
+            copy(wLogW, WLogW);
+            wSum = h.wSum;
+            wSumLogW = h.wSumLogW;
+            e0 = h.e0;
+        }
 
-        fprintf(stderr, "P = %lu, D = %lu, L = %lu\n", P, D, L);
+        propagator.table = Array2D<Propagator::Entry>(h.D, P);
+        copy(propagator.table.data, Table);
+
+        auto flat = [&]<typename T>(T) {
+            vector<T> v;
+            copy(v, Flat);
+            propagator.flat = std::move(v);
+        };
+        if (h.flat_width == 1) flat(uint8_t{});
+        if (h.flat_width == 2) flat(uint16_t{});
+        if (h.flat_width == 4) flat(uint32_t{});
+        propagator.density = h.density;
+
+        built = true;
+        init_engine();
+
+        fprintf(stderr, "P = %lu, D = %lu, L = %lu\n", P, D(), L());
+        return true;
+    }
+
+    /**
+     * State after the initial constraints were propagated, which every
+     * attempt restores instead of re-propagating them. Only kept if clear
+     * has constraints, grounded is false if they contradict (emptying cell
+     * ground_contradicted).
+     */
+    unique_ptr<Solver::Snapshot> ground;
+    bool grounded = true;
+    int64_t ground_contradicted = -1;
+
+    /** Build the model, the solver and the ground snapshot on first use */
+    inline void prepare(ThreadPool* pool = nullptr) {
+        if (solver) return;
+
+        build(pool);
+        solver = make_solver(*this);
+        output = solver.get();
 
         auto b = bytes();
         if (b > 1024 * 1024) {
@@ -148,151 +462,331 @@ class WFC {
         } else {
             fprintf(stderr, "memory usage: %.2fkb\n", b / 1024.f);
         }
+
+        xoshiro256ss rng(0);
+        solver->init(rng);
+        if (clear(*solver)) {
+            grounded = solver->propagate();
+            ground_contradicted = solver->stats.contradicted;
+            ground = solver->snapshot();
+        }
     }
 
-   public:
-    WFC(uint32_t MX, uint32_t MY, uint32_t MZ, size_t N, bool periodic,
-        Heuristic heuristic)
-    noexcept
-        : MX(MX),
-          MY(MY),
-          MZ(MZ),
-          N(N),
-          periodic(periodic),
-          heuristic(heuristic){};
-
-    virtual ~WFC() {
-        if (wave) delete wave;
+    /** Run one attempt on a solver, and return if it succeeded */
+    bool attempt(Solver& s, uint64_t seed, int32_t limit) noexcept {
+        return attempt(s, seed, limit, [](Solver&) { return false; });
     }
 
-    /** Run the algorithm, and return if it succeeded */
-    bool run(uint32_t seed, int32_t limit = -1) noexcept {
+    /**
+     * Same, constrain(s) banning extra patterns on top of the ground ones
+     * before the first observation. It returns true if it banned any.
+     */
+    template <typename F>
+    bool attempt(Solver& s, uint64_t seed, int32_t limit,
+                 const F& constrain) noexcept {
         xoshiro256ss rng(seed);
 
-        if (!wave) {
-            init();
-            post_init();
+        s.stats = {};
 
-            // propagator_copy = propagator;
+        // Start of the current phase
+        [[maybe_unused]] uint64_t t = 0;
+        WFC_STAT(t = ticks());
+
+        if (ground) {
+            if (!grounded) {
+                s.stats.contradicted = ground_contradicted;
+                s.stats.contradicted_at = 0;
+                return false;
+            }
+            s.restore(*ground, rng);
         } else {
-            // propagator = propagator_copy;
+            s.init(rng);
         }
+        WFC_STAT(s.stats.init_ticks = lap(t));
 
-        wave->init(propagator, wSum, wSumLogW, e0);
-
-        if (clear()) {
-            if (!propagate(rng)) return false;
+        if (constrain(s) && !s.propagate()) {
+            s.stats.contradicted_at = 0;
+            return false;
         }
+        WFC_STAT(s.stats.propagate_ticks += lap(t));
 
         for (int32_t l = 0; l < limit || limit < 0; l++) {
-            int32_t index = wave->observe_next(MX, MY, MZ, N, periodic, rng);
-            if (index >= 0) {
-                observe(index, rng);
-                if (!propagate(rng)) return false;
-            } else
-                break;
+            int64_t index = s.observe_next(rng);
+            WFC_STAT(s.stats.select_ticks += lap(t));
+            if (index == -1) break;
+            if (index < 0) return false;
+
+            s.observe(index, rng);
+            WFC_STAT(s.stats.observe_ticks += lap(t));
+            WFC_STAT(s.stats.observations++);
+            WFC_STAT(trace(s, Trace::Kind::Observe, l, index));
+
+            while (true) {
+                [[maybe_unused]] const size_t bans = s.stats.bans;
+                bool propagated = s.propagate();
+                WFC_STAT(s.stats.propagate_ticks += lap(t));
+                WFC_STAT(note_wave(s, l, propagated, s.stats.bans - bans));
+                if (propagated) break;
+
+                s.stats.contradicted_at = l;
+
+                if (s.cancelled()) return false;
+                if (s.stats.backtracks >= backtracks) return false;
+
+                bool undone = s.backtrack();
+                WFC_STAT(s.stats.restore_ticks += lap(t));
+                WFC_STAT(trace(s, Trace::Kind::Backtrack, l, 0,
+                               s.stats.backtracks));
+
+                if (!undone) return false;
+            }
         }
 
         return true;
-    };
+    }
 
-    /** Observe next node */
-    template <typename RNG>
-    void observe(size_t index, RNG& rng) noexcept {
-        for (size_t p = 0; p < P; p++) {
-            distribution[p] = wave->get(index, p) ? weights[p] : 0;
-        }
+   private:
+    /** Ticks since t, which moves to now */
+    static inline uint64_t lap(uint64_t& t) noexcept {
+        const uint64_t now = ticks();
+        const uint64_t elapsed = now - t;
+        t = now;
+        return elapsed;
+    }
 
-        std::uniform_real_distribution<double> next_double(0.0, 1.0);
-        size_t collapsed = sample(distribution, next_double(rng));
+    static inline void trace(Solver& s, Trace::Kind kind, uint32_t step,
+                             uint32_t index = 0, uint64_t value = 0) noexcept {
+        if (s.trace) s.trace->push(kind, step, index, value);
+    }
 
-        for (uint16_t p = 0; p < P; p++) {
-            if (wave->get(index, p) != (p == collapsed)) ban(index, p);
+    /** Account a propagate call that did bans bans */
+    static inline void note_wave(Solver& s, uint32_t step, bool propagated,
+                                 size_t bans) noexcept {
+        s.stats.propagations++;
+        s.stats.largest_wave = std::max(s.stats.largest_wave, bans);
+        if (propagated) {
+            trace(s, Trace::Kind::Propagate, step, 0, bans);
+        } else {
+            trace(s, Trace::Kind::Contradiction, step, s.stats.contradicted,
+                  bans);
         }
-    };
-
-    inline void ban(uint16_t index, uint16_t p) {
-        wave->ban(index, p);
-        stack[stack_len++] = {.index = index, .pattern = p};
     }
 
-    /** Propagate the state */
-    template <typename RNG>
-    NOINLINE bool propagate(RNG& rng) noexcept {
-        while (stack_len) {
-            // Random pop experiment, yields same result
-            /*
-            std::uniform_int_distribution<size_t> index_range(0, stack.size() -
-            1); size_t index = index_range(rng); auto item = stack[index];
-
-            stack[index] = stack.back();
-            */
-            const auto item = stack[stack_len - 1];
-            stack_len--;
+   protected:
+    /**
+     * Per-worker solvers of race and generate_batch, reused across calls.
+     * The winner of a race is swapped into solver.
+     */
+    vector<unique_ptr<Solver>> workers;
+
+    inline void hire(ThreadPool& pool) {
+        prepare(&pool);
+        while (workers.size() < pool.size())
+            workers.push_back(make_solver(*this));
+    }
 
-            const size_t x1 = item.index % MX;
-            const size_t y1 = item.index / MX;
+   private:
+    /** See set_trace */
+    Trace* tracing = nullptr;
 
-            // const size_t y1 = (item.index % (MX * MY)) / MX;
-            // const size_t z1 = item.index / (MX * MY);
+    /** Solver of run_striped, and the arguments it was made for */
+    unique_ptr<ParallelSolver> striped;
+    size_t stripes = 0;
+    bool deterministic = false;
 
-            for (int d = 0; d < wave->D; d++) {
-                const int dx = DX[d], dy = DY[d];  // , dz = DZ[d];
+   public:
+    WFC(uint32_t MX, uint32_t MY, uint32_t MZ, size_t N, bool periodic,
+        Heuristic heuristic, Engine engine = Engine::Auto,
+        uint32_t backtracks = 0, Layout layout = Layout::RowMajor)
+    noexcept
+        : Model(MX, MY, MZ, N, periodic, heuristic, engine, backtracks,
+                layout){};
 
-                int x2 = x1 + dx, y2 = y1 + dy;  // , z2 = z1 + dz;
-                if (!periodic && (x2 < 0 || y2 < 0 ||
-                                  // z2 < 0 ||
-                                  x2 + N > MX || y2 + N > MY))
-                    // || z2 + 1 > MZ))
-                    continue;
+    virtual ~WFC() = default;
 
-                x2 = (x2 + MX) % MX;
-                y2 = (y2 + MY) % MY;
-                // z2 = (z2 + MZ) % MZ;
+    /** Run the algorithm, and return if it succeeded */
+    bool run(uint32_t seed, int32_t limit = -1) noexcept {
+        prepare();
+        output = solver.get();
+        solver->trace = tracing;
+        return attempt(*solver, seed, limit);
+    };
 
-                const size_t i2 = x2 + y2 * MX;  // +z2 * MX * MY;
+    /**
+     * Run the algorithm on the grid split in horizontal stripes, propagated
+     * and observed in parallel across the pool (see StripedSolver), for
+     * outputs too large for one thread. Never backtracks, and contradicts
+     * more often than run as stripes grow apart and meet. stripes defaults
+     * to twice the pool size; pass it with deterministic for results that
+     * do not depend on the pool nor on the thread timings. Return if it
+     * succeeded, the outputs and stats() then reading this run.
+     */
+    bool run_striped(uint32_t seed, ThreadPool& pool, size_t stripes = 0,
+                     bool deterministic = false) {
+        build(&pool);
+        if (propagator.dense.empty()) propagator.densify(P);
+
+        if (!stripes) stripes = 2 * pool.size();
+        if (!striped || stripes != this->stripes ||
+            deterministic != this->deterministic) {
+            striped = make_striped(*this, stripes, deterministic);
+            this->stripes = stripes;
+            this->deterministic = deterministic;
+        }
 
-                const auto entry = propagator.table.get(d, item.pattern);
+        xoshiro256ss rng(seed);
+        striped->stats = {};
+        striped->init(rng);
+        output = striped.get();
 
-                for (size_t pattern_index = entry.offset;
-                     pattern_index < entry.offset + entry.length;
-                     pattern_index++) {
-                    const auto p2 = propagator.flat[pattern_index];
+        clear(*striped);
+        return striped->solve(pool);
+    }
 
-                    if (wave->decre_comp(d, p2, i2) == 0) {
-                        ban(i2, p2);
-                    }
+    /**
+     * Run one attempt per seed across the pool, sharing this model. The
+     * first attempt to succeed wins and cancels the others, its result is
+     * then the one returned by the outputs and stats(). Return the winning
+     * seed, or nullopt if every attempt failed.
+     */
+    optional<uint32_t> race(const vector<uint32_t>& seeds, ThreadPool& pool,
+                            int32_t limit = -1) {
+        hire(pool);
+
+        std::atomic<bool> done = false;
+        size_t winner = 0;
+        optional<uint32_t> result;
+
+        for (auto& r : workers) r->cancel = &done;
+
+        pool.for_each(seeds.size(), [&](size_t task, size_t worker) {
+            if (done.load(std::memory_order_relaxed)) return;
+
+            if (attempt(*workers[worker], seeds[task], limit)) {
+                bool expected = false;
+                if (done.compare_exchange_strong(expected, true)) {
+                    winner = worker;
+                    result = seeds[task];
                 }
             }
-        }
+        });
 
-        return wave->counts[0] > 0;
-    };
+        for (auto& r : workers) r->cancel = nullptr;
+
+        if (result) std::swap(solver, workers[winner]);
+        output = solver.get();
+        return result;
+    }
+
+    /**
+     * Run one attempt per seed across the pool, every worker reusing its
+     * own solver over this shared model. f(const BatchResult&) is called on
+     * the worker thread as soon as each seed finishes, in no particular
+     * order, and must be thread-safe.
+     */
+    template <typename F>
+    void generate_batch(const vector<uint32_t>& seeds, ThreadPool& pool,
+                        const F& f, int32_t limit = -1) {
+        hire(pool);
+
+        pool.for_each(seeds.size(), [&](size_t task, size_t worker) {
+            Solver& s = *workers[worker];
+
+            auto start = std::chrono::steady_clock::now();
+            bool success = attempt(s, seeds[task], limit);
+            double ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+
+            f(BatchResult{.seed = seeds[task],
+                          .success = success,
+                          .ms = ms,
+                          .contradictions = s.stats.backtracks + !success,
+                          .worker = worker,
+                          .solver = s});
+        });
+    }
+
+    /** Statistics of the last run */
+    inline const Stats& stats() const { return output->stats; }
 
+    /**
+     * Log the steps of the next runs (not races nor batches) to trace, or
+     * stop if nullptr. Needs WFC_STATS.
+     */
+    inline void set_trace(Trace* trace) noexcept { tracing = trace; }
+
+    /**
+     * Ordinal of every value of data in uniques, the values missing from it
+     * being appended in first-seen order. Values are looked up in a hash
+     * table, runs of the same value reuse the previous ordinal.
+     */
     template <typename O, typename T>
     inline vector<O> ords(const vector<T>& data, vector<T>& uniques) {
+        std::unordered_map<T, O> ordinals;
+        for (size_t u = 0; u < uniques.size(); u++)
+            ordinals.emplace(uniques[u], static_cast<O>(u));
+
         vector<O> result(data.size());
         for (size_t i = 0; i < data.size(); i++) {
-            const T& d = data[i];
-            auto iter = std::find(uniques.begin(), uniques.end(), d);
-
-            O ord = std::distance(uniques.begin(), iter);
-            if (iter == uniques.end()) {
-                ord = static_cast<O>(uniques.size());
-                uniques.push_back(d);
+            if (i && data[i] == data[i - 1]) {
+                result[i] = result[i - 1];
+                continue;
             }
-            result[i] = ord;
+
+            const auto [it, added] = ordinals.try_emplace(
+                data[i], static_cast<O>(uniques.size()));
+            if (added) uniques.push_back(data[i]);
+            result[i] = it->second;
         }
         return result;
     }
 
+    /**
+     * Input colors keeping bits bits of each channel, alpha aside: every
+     * channel is rounded to the nearest of 2^bits levels spread over 0-255
+     */
+    static vector<uint32_t> quantize(const vector<uint32_t>& data,
+                                     uint32_t bits) {
+        const uint32_t levels = (1 << bits) - 1;
+        uint32_t channel[256];
+        for (uint32_t v = 0; v < 256; v++)
+            channel[v] = (v * levels + 127) / 255 * 255 / levels;
+
+        vector<uint32_t> result(data.size());
+        for (size_t i = 0; i < data.size(); i++) {
+            const uint32_t c = data[i];
+            result[i] = (c & 0xFF000000) | channel[(c >> 16) & 0xFF] << 16 |
+                        channel[(c >> 8) & 0xFF] << 8 | channel[c & 0xFF];
+        }
+        return result;
+    }
+
+    /**
+     * Color ordinals of an input, colors being set to the colors they stand
+     * for. Keeps bits bits of each channel (see quantize), fewer if the
+     * input still has more than MAX_COLORS colors.
+     */
+    inline vector<uint32_t> color_ords(const vector<uint32_t>& data,
+                                       uint32_t bits,
+                                       vector<uint32_t>& colors) {
+        bits = std::clamp<uint32_t>(bits, 1, 8);
+        while (true) {
+            colors.clear();
+            auto sample = ords<uint32_t>(
+                bits < 8 ? quantize(data, bits) : data, colors);
+            if (colors.size() <= MAX_COLORS || bits == 1) return sample;
+
+            fprintf(stderr, "%zu colors, quantizing to %u bits per channel\n",
+                    colors.size(), bits - 1);
+            bits--;
+        }
+    }
+
+    /** Memory held by the model and whichever solvers it has built */
     inline size_t bytes() {
-        return wave->bytes() +
-               propagator.table.data.size() * sizeof(Propagator::Entry) +
-               propagator.flat.size() * sizeof(propagator.flat[0]) +
-               stack.capacity() * sizeof(stack[0]) +
-               weights.size() * sizeof(weights[0]) +
-               wLogW.size() * sizeof(wLogW[0]);
+        return (solver ? solver->bytes() : 0) +
+               (striped ? striped->bytes() : 0) + Model::bytes();
     }
 };
 
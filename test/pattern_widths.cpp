@@ -0,0 +1,53 @@
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "tiled_wfc.hpp"
+
+using namespace std;
+
+/**
+ * Regression test of the pattern id widths: the propagator lists and the
+ * solver have to agree on the id type at the boundaries, where P is exactly
+ * 256 or 65536. Every tile only fits next to itself, so an output is one
+ * tile repeated and every run has to succeed.
+ */
+static bool run(uint32_t P, WFC::Engine engine) {
+    vector<TiledWFC::Tile> tiles(P, {.symmetry = 'X'});
+    vector<TiledWFC::Neighbor> rules;
+    for (uint32_t t = 0; t < P; t++) rules.push_back({t, 0, t, 0});
+
+    TiledWFC::Options options = {.periodic_output = true,
+                                 .o_W = 4,
+                                 .o_H = 4,
+                                 .heuristic = WFC::Heuristic::Entropy,
+                                 .engine = engine,
+                                 .backtracks = 0};
+    TiledWFC wfc(options, tiles, rules);
+    if (!wfc.run(1)) return false;
+
+    const auto out = wfc.get_output();
+    for (const auto t : out.data) {
+        if (t != out.data[0]) return false;
+    }
+    return true;
+}
+
+int main() {
+    int failures = 0;
+    auto check = [&](uint32_t P, WFC::Engine engine, const char *name) {
+        const bool ok = run(P, engine);
+        cout << name << " P = " << P << (ok ? " ok" : " FAILED") << endl;
+        failures += !ok;
+    };
+
+    for (uint32_t P : {255u, 256u, 257u}) {
+        check(P, WFC::Engine::Sparse, "sparse");
+        check(P, WFC::Engine::Dense, "dense");
+    }
+    // The dense rows of 65536 patterns would take gigabytes
+    for (uint32_t P : {65535u, 65536u, 65537u})
+        check(P, WFC::Engine::Sparse, "sparse");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+#include <cstdint>
+#include <iostream>
+#include <set>
+#include <vector>
+
+#include "voxel_wfc.hpp"
+
+using namespace std;
+
+/**
+ * Regression test of the voxel model under both layouts and engines: every
+ * N x N x N window of an output has to be one of the extracted patterns,
+ * and with the ground every window of the bottom layer one seen at the
+ * bottom of the input.
+ */
+class Probe : public VoxelWFC {
+   public:
+    using VoxelWFC::VoxelWFC;
+
+    /** The patterns in the input colors, all or only the bottom ones */
+    set<vector<uint32_t>> windows(bool floor) const {
+        set<vector<uint32_t>> out;
+        for (size_t p = 0; p < P; p++) {
+            if (floor && !bottom[p]) continue;
+            vector<uint32_t> w;
+            for (const auto c : patterns[p]) w.push_back(colors[c]);
+            out.insert(w);
+        }
+        return out;
+    }
+};
+
+/** A flat ground under layers of stripes turning with z */
+static Array3D<uint32_t> sample() {
+    Array3D<uint32_t> in(6, 6, 4);
+    for (size_t z = 0; z < in.MZ; z++)
+        for (size_t y = 0; y < in.MY; y++)
+            for (size_t x = 0; x < in.MX; x++) {
+                const size_t u = z % 2 ? x : y;
+                in.set(x, y, z, z ? 0xff000000 | (u % 3) * 0x404040 : 0xff00ff);
+            }
+    return in;
+}
+
+static bool run(Layout layout, WFC::Engine engine, bool ground) {
+    const auto input = sample();
+    const size_t N = 2;
+
+    VoxelWFC::Options options = {.periodic_input = true,
+                                 .periodic_output = false,
+                                 .o_X = 12,
+                                 .o_Y = 10,
+                                 .o_Z = 9,
+                                 .symmetry = 255,
+                                 .pattern_size = N,
+                                 .heuristic = WFC::Heuristic::Entropy,
+                                 .ground = ground,
+                                 .engine = engine,
+                                 .backtracks = 64,
+                                 .layout = layout};
+    Probe wfc(options, input);
+
+    bool solved = false;
+    for (uint32_t seed = 1; seed <= 8 && !solved; seed++) {
+        solved = wfc.run(seed);
+    }
+    if (!solved) return false;
+
+    const auto out = wfc.get_output();
+    const auto all = wfc.windows(false), floor = wfc.windows(true);
+
+    vector<uint32_t> w(N * N * N);
+    for (size_t z = 0; z + N <= out.MZ; z++)
+        for (size_t y = 0; y + N <= out.MY; y++)
+            for (size_t x = 0; x + N <= out.MX; x++) {
+                for (size_t i = 0; i < w.size(); i++) {
+                    w[i] = out.get(x + i % N, y + i / N % N, z + i / N / N);
+                }
+                if (!all.count(w)) return false;
+                if (ground && !z && !floor.count(w)) return false;
+            }
+    return true;
+}
+
+int main() {
+    int failures = 0;
+    for (const auto layout : {Layout::RowMajor, Layout::Tiled})
+        for (const auto engine : {WFC::Engine::Sparse, WFC::Engine::Dense})
+            for (const bool ground : {false, true}) {
+                const bool ok = run(layout, engine, ground);
+                cout << (layout == Layout::Tiled ? "tiled" : "row-major")
+                     << (engine == WFC::Engine::Dense ? " dense" : " sparse")
+                     << (ground ? " ground" : "") << (ok ? " ok" : " FAILED")
+                     << endl;
+                failures += !ok;
+            }
+    return failures ? 1 : 0;
+}